@@ -9,7 +9,10 @@
  *
  */
 
-#define _XOPEN_SOURCE 500
+#if defined(__linux__)
+#define _GNU_SOURCE /* for sched_setaffinity */
+#endif
+#define _XOPEN_SOURCE 600
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +21,7 @@
 #include <getopt.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 
 #if defined(_WIN32)
 #include <windows.h>
@@ -27,6 +31,8 @@
 #define strncasecmp _strnicmp
 #else
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
 #endif
 
 #if defined(__FreeBSD__) || defined(_WIN32)
@@ -40,13 +46,31 @@ int snprintf(char * __restrict __str, size_t __size, const char * __restrict __f
 #endif
 
 #if _POSIX_C_SOURCE >= 199309L
-#include <time.h>   /* for nanosleep */
+#include <time.h>   /* for nanosleep and clock_gettime */
+#elif !defined(_WIN32)
+#include <sys/time.h> /* for gettimeofday */
 #endif
 
+/*
+ * In dry run mode no requests changing hub state are sent,
+ * and sleeps only advance virtual clock, so that time_us()
+ * returns time at which things would have happened.
+ */
+static int opt_dry_run = 0;
+static int64_t dry_run_clock = 0;   /* us of skipped sleeps */
+static int64_t dry_run_pending = 0; /* us of sleeps not printed yet */
+static int64_t dry_run_t0 = 0;      /* time when dry run started */
+static int dry_run_requests = 0;
+
 /* cross-platform sleep function */
 
 void sleep_ms(int milliseconds)
 {
+    if (opt_dry_run) {
+        dry_run_clock   += (int64_t)milliseconds * 1000;
+        dry_run_pending += (int64_t)milliseconds * 1000;
+        return;
+    }
 #if defined(_WIN32)
     Sleep(milliseconds);
 #elif _POSIX_C_SOURCE >= 199309L
@@ -59,24 +83,109 @@ void sleep_ms(int milliseconds)
 #endif
 }
 
+/* cross-platform monotonic clock in microseconds */
+
+int64_t time_us()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return count.QuadPart / freq.QuadPart * 1000000 +
+           count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart +
+           dry_run_clock;
+#elif _POSIX_C_SOURCE >= 199309L
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + dry_run_clock;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec + dry_run_clock;
+#endif
+}
+
+/* sleep until absolute time_us() deadline */
+
+void sleep_until_us(int64_t deadline)
+{
+    if (opt_dry_run) {
+        int64_t now = time_us();
+        if (deadline > now) {
+            dry_run_clock   += deadline - now;
+            dry_run_pending += deadline - now;
+        }
+        return;
+    }
+#if defined(TIMER_ABSTIME) && !defined(__APPLE__)
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+    int64_t now = time_us();
+    if (deadline > now)
+        sleep_ms((int)((deadline - now + 999) / 1000));
+#endif
+}
+
 /* Max number of hub ports supported.
- * This is somewhat artifically limited by "-p" option parser.
- * If "-p" parser is improved, we can support up to 32 ports.
- * However, biggest number of ports on smart hub I've seen was 8.
+ * Biggest number of ports on smart hub I've seen was 8.
  * I've also observed onboard USB hub with whopping 14 ports,
  * but that hub did not support per-port power switching.
+ * USB3 hubs can have at most 15 ports, but only 14 are supported here.
  */
-#define MAX_HUB_PORTS            9
+#define MAX_HUB_PORTS            14
 #define ALL_HUB_PORTS            ((1 << MAX_HUB_PORTS) - 1) /* bitmask */
 
 #define USB_CTRL_GET_TIMEOUT     5000
 
+#define POWER_WAVE_MIN_DELAY     10   /* min delay in ms between power on waves */
+
+#define ENUM_POLL_INTERVAL       10   /* ms between port status polls */
+#define LPM_SAMPLE_INTERVAL      10   /* ms between link state samples */
+#define ENUM_CONNECT_TIMEOUT     200  /* ms after power good to see connection */
+#define ENUM_TIMEOUT             5000 /* max ms to wait for device to enumerate */
+
 #define USB_PORT_FEAT_POWER      (1 << 3)
 
+/* Port feature selectors, see USB 2.0 spec Table 11-17 and USB 3.0 Table 10-9 */
+#define USB_PORT_FEAT_SUSPEND           2
+#define USB_PORT_FEAT_RESET             4
+#define USB_PORT_FEAT_LINK_STATE        5  /* USB 3.0 only */
+#define USB_PORT_FEAT_C_CONNECTION      16
+#define USB_PORT_FEAT_C_ENABLE          17 /* USB 2.0 only */
+#define USB_PORT_FEAT_C_SUSPEND         18 /* USB 2.0 only */
+#define USB_PORT_FEAT_C_OVER_CURRENT    19
+#define USB_PORT_FEAT_C_RESET           20
+#define USB_PORT_FEAT_U1_TIMEOUT        23 /* USB 3.0 only */
+#define USB_PORT_FEAT_U2_TIMEOUT        24 /* USB 3.0 only */
+#define USB_PORT_FEAT_C_LINK_STATE      25 /* USB 3.0 only */
+#define USB_PORT_FEAT_C_CONFIG_ERROR    26 /* USB 3.0 only */
+#define USB_PORT_FEAT_BH_PORT_RESET     28
+#define USB_PORT_FEAT_C_BH_PORT_RESET   29
+
+#define CONTROL_RETRIES          3    /* max retries of transient failure */
+#define CONTROL_RETRY_WAIT       10   /* ms before first retry, then doubled */
+#define CALIBRATE_RETRY          100  /* ms before repeating power off in calibration */
+#define CALIBRATE_TIMEOUT        2000 /* max ms to wait for port to turn off/on */
+#define PORT_RESUME_TIMEOUT      1000 /* max ms to wait for suspend/resume */
+#define WAIT_POLL_INTERVAL       100  /* ms between checks when no event arrives */
+
 #define POWER_KEEP               (-1)
 #define POWER_OFF                0
 #define POWER_ON                 1
 #define POWER_CYCLE              2
+#define POWER_TOGGLE             3
+#define POWER_PULSE              4
+#define POWER_MIXED              5  /* per-port actions in opt_port_actions[] */
+#define POWER_RESTORE            6  /* restore power state from snapshot */
+#define PORT_RESET               7  /* per-port reset, power is not changed */
+#define PORT_SUSPEND             8  /* selective suspend (U3 for USB3) */
+#define PORT_RESUME              9  /* resume from suspend (U0 for USB3) */
+#define HUB_CALIBRATE            10 /* measure hub timing and save it */
+#define DEVICE_REBOOT            11 /* cycle port of -V device, wait for it */
+#define PORT_WAIT                12 /* wait until --until condition holds */
 
 #define MAX_HUB_CHAIN            8  /* Per USB 3.0 spec max hub chain is 7 */
 
@@ -105,6 +214,19 @@ struct usb_port_status {
 };
 #pragma pack(pop)
 
+/*
+ * wHubStatus and wHubChange bit fields
+ * See USB 2.0 spec Table 11-19 and Table 11-20
+ */
+#define HUB_STATUS_LOCAL_POWER          0x0001 /* local power supply lost */
+#define HUB_STATUS_OVERCURRENT          0x0002
+#define HUB_CHANGE_LOCAL_POWER          0x0001
+#define HUB_CHANGE_OVERCURRENT          0x0002
+
+/* Hub feature selectors, see USB 2.0 spec Table 11-17 */
+#define C_HUB_LOCAL_POWER               0
+#define C_HUB_OVER_CURRENT              1
+
 /*
  * wPortStatus bit field
  * See USB 2.0 spec Table 11-21
@@ -123,6 +245,19 @@ struct usb_port_status {
 #define USB_PORT_STAT_INDICATOR         0x1000
 /* bits 13 to 15 are reserved */
 
+/*
+ * wPortChange bit field
+ * See USB 2.0 spec Table 11-22 and USB 3.0 spec Table 10-12
+ */
+#define USB_PORT_STAT_C_CONNECTION      0x0001
+#define USB_PORT_STAT_C_ENABLE          0x0002
+#define USB_PORT_STAT_C_SUSPEND         0x0004
+#define USB_PORT_STAT_C_OVERCURRENT     0x0008
+#define USB_PORT_STAT_C_RESET           0x0010
+#define USB_PORT_STAT_C_BH_RESET        0x0020 /* USB 3.0 only */
+#define USB_PORT_STAT_C_LINK_STATE      0x0040 /* USB 3.0 only */
+#define USB_PORT_STAT_C_CONFIG_ERROR    0x0080 /* USB 3.0 only */
+
 
 #define USB_SS_BCD                      0x0300
 /*
@@ -157,6 +292,19 @@ struct usb_port_status {
 #define USB_SS_PORT_LS_COMP_MOD         0x0140
 #define USB_SS_PORT_LS_LOOPBACK         0x0160
 
+/*
+ * USB 3.1 extended port status (GET_STATUS with wValue PORT_EXT_STATUS)
+ * See USB 3.1 spec Table 10-13
+ */
+#define USB_SSP_BCD                     0x0310
+#define USB_PORT_EXT_STATUS             2
+#define USB_EXT_PORT_RX_SSID(s)         ((s) & 0x0f)
+#define USB_EXT_PORT_RX_LANES(s)        ((((s) >> 8) & 0x0f) + 1)
+
+#define USB_DT_DEVICE_QUALIFIER         0x06
+#define USB_BT_SUPERSPEED               0x03 /* SuperSpeed USB capability */
+#define USB_BT_SUPERSPEED_PLUS          0x0a /* SuperSpeedPlus capability */
+
 
 /*
  * wHubCharacteristics (masks)
@@ -185,12 +333,51 @@ struct hub_info {
     int bcd_usb;
     int nports;
     int ppps;
+    int fixed_ports; /* bitmask of non-removable ports */
+    int pwr_on_2_good; /* time in ms for power to become good on a port */
+    int contr_current; /* max current in mA required by hub controller */
+    int dual;       /* index of USB2/USB3 dual hub in hubs[], or -1 */
+    int64_t off_time[MAX_HUB_PORTS+1]; /* time_us() when port was switched off */
+    int64_t on_time[MAX_HUB_PORTS+1];  /* time_us() when port was switched on */
     int actionable; /* true if this hub is subject to action */
+    int port_error[MAX_HUB_PORTS+1];    /* last failed request, 0 if ok */
+    int port_attempts[MAX_HUB_PORTS+1]; /* attempts used by last request */
+    int dry_run_set;   /* ports with power switched in dry run */
+    int dry_run_power; /* their simulated power state */
+    int restore_power; /* bitmask of ports powered in snapshot */
+    int off_attempts; /* max power off attempts needed by any port */
+    int repeat;     /* power off request count, from -r or quirks */
+    int wait;       /* ms between repeated requests, from -w or quirks */
+    int settle;     /* ms ports take to actually turn off after request */
+    int no_dual;    /* do not switch USB2/USB3 dual hub together */
+    int calibrated; /* repeat/wait/settle were measured in this run */
+    int where_ports; /* ports matching --where predicate */
+    int changes_cleared; /* change bits were already cleared by -C */
     char vendor[16];
     char location[32];
     char description[256];
 };
 
+/*
+ * Known behavior of specific hub models, keyed by VID:PID,
+ * or of specific hub, keyed by VID:PID@location (from calibration).
+ * Fields set to -1 are not overridden.
+ */
+struct hub_quirk {
+    char id[64];
+    int repeat;     /* power off request count */
+    int wait;       /* ms between repeated requests */
+    int settle;     /* ms to wait after power off */
+    int dual;       /* 0 if USB2/USB3 dual hub must not be switched together */
+};
+
+#define MAX_QUIRKS 64
+static struct hub_quirk file_quirks[MAX_QUIRKS]; /* loaded with -Q */
+static int file_quirk_count = 0;
+
+/* Quirks file used when -Q is not given, relative to home directory */
+#define DEFAULT_QUIRKS_FILE ".uhubctl-quirks"
+
 /* Array of all enumerated USB hubs */
 #define MAX_HUBS 128
 static struct hub_info hubs[MAX_HUBS];
@@ -199,14 +386,85 @@ static int hub_phys_count = 0;
 
 /* default options */
 static char opt_vendor[16]   = "";
-static char opt_location[32] = "";     /* Hub location a-b.c.d */
+static char opt_location[256] = "";    /* Hub location(s) a-b.c.d[,...] */
 static int opt_ports  = ALL_HUB_PORTS; /* Bitmask of ports to operate on */
+static int opt_ports_set = 0; /* -p given */
 static int opt_action = POWER_KEEP;
-static int opt_delay  = 2;
+static int opt_port_actions[MAX_HUB_PORTS]; /* for POWER_MIXED */
+static int64_t opt_delay = 2000000; /* in microseconds */
 static int opt_repeat = 1;
 static int opt_wait   = 20; /* wait before repeating in ms */
+static int opt_repeat_set = 0; /* -r given, overrides quirks */
+static int opt_wait_set   = 0; /* -w given, overrides quirks */
+static char opt_quirks[256] = ""; /* quirks and calibration file */
+
+/*
+ * Port conditions usable in --where and --until predicates.
+ * USB3 port status is converted to USB2 layout before matching.
+ * present is not port condition: it holds if -V device is present.
+ */
+static const struct {
+    const char * name;
+    int status;     /* wPortStatus bit */
+    int change;     /* wPortChange bit */
+} port_conditions[] = {
+    { "power",     USB_PORT_STAT_POWER,       0 },
+    { "connect",   USB_PORT_STAT_CONNECTION,  0 },
+    { "enable",    USB_PORT_STAT_ENABLE,      0 },
+    { "suspend",   USB_PORT_STAT_SUSPEND,     0 },
+    { "oc",        USB_PORT_STAT_OVERCURRENT, 0 },
+    { "reset",     USB_PORT_STAT_RESET,       0 },
+    { "highspeed", USB_PORT_STAT_HIGH_SPEED,  0 },
+    { "lowspeed",  USB_PORT_STAT_LOW_SPEED,   0 },
+    { "c_connect", 0, USB_PORT_STAT_C_CONNECTION  },
+    { "c_enable",  0, USB_PORT_STAT_C_ENABLE      },
+    { "c_suspend", 0, USB_PORT_STAT_C_SUSPEND     },
+    { "c_oc",      0, USB_PORT_STAT_C_OVERCURRENT },
+    { "c_reset",   0, USB_PORT_STAT_C_RESET       },
+    { "present",   0, 0 },
+};
+
+/*
+ * --where and --until predicates: port matches if any term matches,
+ * term matches if all its conditions in set mask hold
+ * and none of conditions in clear mask hold.
+ */
+#define MAX_WHERE_TERMS 8
+struct condition_term {
+    int set;
+    int clear;
+};
+static struct condition_term opt_where[MAX_WHERE_TERMS];
+static int opt_where_count = 0;
+static struct condition_term opt_until[MAX_WHERE_TERMS];
+static int opt_until_count = 0;
 static int opt_exact  = 0;  /* exact location match - disable USB3 duality handling */
 static int opt_reset  = 0;  /* reset hub after operation(s) */
+static int opt_adaptive = 0; /* max power off attempts in adaptive mode, 0 = disabled */
+static int opt_budget = 0;   /* current budget in mA per power on wave, 0 = unlimited */
+static int opt_enum   = 0;  /* max ports per bus enumerating at once, 0 = unlimited */
+static int opt_sync   = 0;  /* submit all power requests at once */
+static int opt_realtime = 0; /* real-time priority and absolute deadlines */
+static int opt_count  = 1;  /* number of cycle/pulse/toggle iterations */
+static int64_t opt_period = 0; /* microseconds between iterations, 0 = auto */
+static char opt_snapshot[256] = ""; /* snapshot file of port power states */
+static int opt_u1_timeout = -1; /* USB3 port U1 timeout to set, -1 = keep */
+static int opt_u2_timeout = -1; /* USB3 port U2 timeout to set, -1 = keep */
+static int64_t opt_residency = 0; /* link state sampling window in us, 0 = none */
+static int opt_clear  = 0;  /* clear port change bits after reading status */
+/* USB device given as VID:PID/SERIAL, see parse_device() */
+struct device_spec {
+    int vid;          /* -1 = any */
+    int pid;          /* -1 = any */
+    char serial[64];  /* empty = any */
+};
+
+static struct device_spec opt_device = { -1, -1, "" }; /* -V device */
+static int opt_device_set = 0;
+static int64_t opt_timeout = 30000000; /* max time to wait in microseconds */
+static char opt_script[256] = ""; /* sequence script file */
+static char opt_graph[256] = "";  /* dependency graph file */
+/* opt_dry_run is declared above sleep_ms() */
 
 static const struct option long_options[] = {
     { "loc",      required_argument, NULL, 'l' },
@@ -218,6 +476,25 @@ static const struct option long_options[] = {
     { "wait",     required_argument, NULL, 'w' },
     { "exact",    no_argument,       NULL, 'e' },
     { "reset",    no_argument,       NULL, 'R' },
+    { "adaptive", required_argument, NULL, 'A' },
+    { "budget",   required_argument, NULL, 'B' },
+    { "enum",     required_argument, NULL, 'E' },
+    { "sync",     no_argument,       NULL, 'y' },
+    { "realtime", no_argument,       NULL, 'T' },
+    { "count",    required_argument, NULL, 'c' },
+    { "period",   required_argument, NULL, 't' },
+    { "snapshot", required_argument, NULL, 'S' },
+    { "lpm",      required_argument, NULL, 'L' },
+    { "residency", required_argument, NULL, 'M' },
+    { "clear",    no_argument,       NULL, 'C' },
+    { "dry-run",  no_argument,       NULL, 'D' },
+    { "quirks",   required_argument, NULL, 'Q' },
+    { "where",    required_argument, NULL, 'W' },
+    { "until",    required_argument, NULL, 'U' },
+    { "device",   required_argument, NULL, 'V' },
+    { "timeout",  required_argument, NULL, 'o' },
+    { "script",   required_argument, NULL, 's' },
+    { "graph",    required_argument, NULL, 'g' },
     { "version",  no_argument,       NULL, 'v' },
     { "help",     no_argument,       NULL, 'h' },
     { 0,          0,                 NULL, 0   },
@@ -232,315 +509,4226 @@ static int print_usage()
         "Without options, show status for all smart hubs.\n"
         "\n"
         "Options [defaults in brackets]:\n"
-        "--action,   -a - action to off/on/cycle (0/1/2) for affected ports.\n"
-        "--ports,    -p - ports to operate on    [all hub ports].\n"
-        "--loc,      -l - limit hub by location  [all smart hubs].\n"
+        "--action,   -a - action to off/on/cycle/toggle/pulse (0/1/2/3/4) for affected ports,\n"
+        "                 or per-port actions like 1=on,2-3=off,4=cycle,\n"
+        "                 or restore to restore power state from snapshot file,\n"
+        "                 or reset to reset devices on ports without power cycle,\n"
+        "                 or suspend/resume to suspend or resume ports (U3/U0 for USB3),\n"
+        "                 or calibrate to measure hub timing and save it to quirks file,\n"
+        "                 or reboot to cycle port of -V device and wait until it is back,\n"
+        "                 or wait to wait until -U condition holds or -V device is present.\n"
+        "--ports,    -p - ports to operate on    [all removable hub ports] (like 1,3-5).\n"
+        "--loc,      -l - limit hub by location  [all smart hubs] (comma separated list ok).\n"
         "--vendor,   -n - limit hub by vendor id [%s] (partial ok).\n"
-        "--delay,    -d - delay for cycle action [%d sec].\n"
+        "--delay,    -d - delay for cycle/pulse action [%g sec] (ms and us suffix ok).\n"
         "--repeat,   -r - repeat power off count [%d] (some devices need it to turn off).\n"
         "--exact,    -e - exact location (no USB3 duality handling).\n"
         "--reset,    -R - reset hub after each power-on action, causing all devices to reassociate.\n"
         "--wait,     -w - wait before repeat power off [%d ms].\n"
+        "--adaptive, -A - repeat power off until port is off, up to N times.\n"
+        "--budget,   -B - power on ports in waves within current budget [mA].\n"
+        "--enum,     -E - power on letting only N ports per bus enumerate at once.\n"
+        "--sync,     -y - switch all ports on all hubs at once and report skew.\n"
+        "--realtime, -T - use real-time priority for precise timing (needs root).\n"
+        "--count,    -c - number of cycle/pulse/toggle iterations [%d].\n"
+        "--period,   -t - period of iterations [2x delay, 1x for toggle] (ms and us suffix ok).\n"
+        "--snapshot, -S - save port power state of all hubs to file (- for stdout).\n"
+        "--lpm,      -L - set USB3 port U1,U2 timeouts (0 or off disables LPM).\n"
+        "--residency,-M - sample USB3 link state residency for given time.\n"
+        "--clear,    -C - clear hub and port change bits after showing them once\n"
+        "                 (kernel hub driver may then miss these events).\n"
+        "--dry-run,  -D - print requests and sleeps with estimated time, do not change ports.\n"
+        "--quirks,   -Q - per-model hub quirks (repeat, wait, settle, dual) file [~/%s].\n"
+        "--where,    -W - act only on ports matching condition, like !connect or oc|!enable.\n"
+        "--until,    -U - condition to wait for, like connect, !power or !present.\n"
+        "--device,   -V - device to reboot or wait for as VID:PID, /SERIAL or VID:PID/SERIAL.\n"
+        "--timeout,  -o - max time to wait for device or condition [%g sec] (ms and us suffix ok).\n"
+        "--script,   -s - run sequence of timed steps from file (- for stdin).\n"
+        "--graph,    -g - run steps from file as dependency graph, in parallel where possible.\n"
         "--version,  -v - print program version.\n"
         "--help,     -h - print this text.\n"
         "\n"
         "Send bugs and requests to: https://github.com/mvp/uhubctl\n",
         PROGRAM_VERSION,
         strlen(opt_vendor) ? opt_vendor : "any",
-        opt_delay,
+        opt_delay / 1000000.0,
         opt_repeat,
-        opt_wait
+        opt_wait,
+        opt_count,
+        DEFAULT_QUIRKS_FILE,
+        opt_timeout / 1000000.0
     );
     return 0;
 }
 
 
-/* trim trailing spaces from a string */
+/*
+ * Parse duration like "2", "0.35", "1.5s", "350ms" or "500us".
+ * Plain number is in seconds, and duration must be finite and
+ * fit into int milliseconds.
+ * Returns duration in microseconds, or -1 if it is not valid.
+ */
 
-static char* rtrim(char* str)
+static int64_t parse_duration(const char* str)
 {
-    int i;
-    for (i = strlen(str)-1; i>=0 && isspace(str[i]); i--) {
-        str[i] = 0;
-    }
-    return str;
+    char* end;
+    double value = strtod(str, &end);
+    if (end == str || !(value >= 0)) /* also rejects nan */
+        return -1;
+    if (*end == 0 || !strcasecmp(end, "s"))
+        value *= 1000000;
+    else if (!strcasecmp(end, "ms"))
+        value *= 1000;
+    else if (strcasecmp(end, "us"))
+        return -1;
+    if (value > (double)INT_MAX * 1000) /* also rejects inf */
+        return -1;
+    return (int64_t)(value + 0.5);
 }
 
 
 /*
- * get USB hub properties.
- * most hub_info fields are filled, except for description.
- * returns 0 for success and error code for failure.
+ * Parse positive decimal count.
+ * Returns count, or -1 if it is not valid.
  */
 
-static int get_hub_info(struct libusb_device *dev, struct hub_info *info)
+static int parse_count(const char* str)
 {
-    int rc = 0;
-    int len = 0;
-    struct libusb_device_handle *devh = NULL;
-    unsigned char buf[LIBUSB_DT_HUB_NONVAR_SIZE + 2 + 3] = {0};
-    struct usb_hub_descriptor *uhd = (struct usb_hub_descriptor *)buf;
-    int minlen = LIBUSB_DT_HUB_NONVAR_SIZE + 2;
-    struct libusb_device_descriptor desc;
-    rc = libusb_get_device_descriptor(dev, &desc);
-    if (rc)
-        return rc;
-    if (desc.bDeviceClass != LIBUSB_CLASS_HUB)
-        return LIBUSB_ERROR_INVALID_PARAM;
-    int bcd_usb = libusb_le16_to_cpu(desc.bcdUSB);
-    int desc_type = bcd_usb >= USB_SS_BCD ? LIBUSB_DT_SUPERSPEED_HUB
-                                          : LIBUSB_DT_HUB;
-    rc = libusb_open(dev, &devh);
-    if (rc == 0) {
-        len = libusb_control_transfer(devh,
-            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
-                               | LIBUSB_RECIPIENT_DEVICE, /* hub status */
-            LIBUSB_REQUEST_GET_DESCRIPTOR,
-            desc_type << 8,
-            0,
-            buf, sizeof(buf),
-            USB_CTRL_GET_TIMEOUT
-        );
+    char* end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (end == str || *end != 0 || errno != 0 || value <= 0 || value > INT_MAX)
+        return -1;
+    return (int)value;
+}
 
-        if (len >= minlen) {
-            unsigned char port_numbers[MAX_HUB_CHAIN] = {0};
-            info->dev     = dev;
-            info->bcd_usb = bcd_usb;
-            info->nports  = uhd->bNbrPorts;
-            snprintf(
-                info->vendor, sizeof(info->vendor),
-                "%04x:%04x",
-                libusb_le16_to_cpu(desc.idVendor),
-                libusb_le16_to_cpu(desc.idProduct)
-            );
 
-            /* Convert bus and ports array into USB location string */
-            int bus = libusb_get_bus_number(dev);
-            snprintf(info->location, sizeof(info->location), "%d", bus);
-#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
-            /*
-             * libusb_get_port_path is deprecated since libusb v1.0.16,
-             * therefore use libusb_get_port_numbers when supported
-             */
-            int pcount = libusb_get_port_numbers(dev, port_numbers, MAX_HUB_CHAIN);
-#else
-            int pcount = libusb_get_port_path(NULL, dev, port_numbers, MAX_HUB_CHAIN);
-#endif
-            int k;
-            for (k=0; k<pcount; k++) {
-                char s[8];
-                snprintf(s, sizeof(s), "%s%d", k==0 ? "-" : ".", port_numbers[k]);
-                strcat(info->location, s);
-            }
+/*
+ * Parse action name or number.
+ * Returns action, or -2 if it is not valid.
+ */
 
-            info->ppps = 0;
-            /* Logical Power Switching Mode */
-            int lpsm = uhd->wHubCharacteristics[0] & HUB_CHAR_LPSM;
-            /* Over-Current Protection Mode */
-            int ocpm = uhd->wHubCharacteristics[0] & HUB_CHAR_OCPM;
-            /* LPSM must be supported per-port, and OCPM per port or ganged */
-            if ((lpsm == HUB_CHAR_INDV_PORT_LPSM) &&
-                (ocpm == HUB_CHAR_INDV_PORT_OCPM ||
-                 ocpm == HUB_CHAR_COMMON_OCPM))
-            {
-                info->ppps = 1;
-            }
-        } else {
-            rc = len;
+static int parse_action(const char* str)
+{
+    if (!strcasecmp(str, "off")    || !strcasecmp(str, "0"))
+        return POWER_OFF;
+    if (!strcasecmp(str, "on")     || !strcasecmp(str, "1"))
+        return POWER_ON;
+    if (!strcasecmp(str, "cycle")  || !strcasecmp(str, "2"))
+        return POWER_CYCLE;
+    if (!strcasecmp(str, "toggle") || !strcasecmp(str, "3"))
+        return POWER_TOGGLE;
+    if (!strcasecmp(str, "pulse")  || !strcasecmp(str, "4"))
+        return POWER_PULSE;
+    if (!strcasecmp(str, "restore"))
+        return POWER_RESTORE;
+    if (!strcasecmp(str, "reset"))
+        return PORT_RESET;
+    if (!strcasecmp(str, "suspend"))
+        return PORT_SUSPEND;
+    if (!strcasecmp(str, "resume"))
+        return PORT_RESUME;
+    if (!strcasecmp(str, "calibrate"))
+        return HUB_CALIBRATE;
+    if (!strcasecmp(str, "reboot"))
+        return DEVICE_REBOOT;
+    if (!strcasecmp(str, "wait"))
+        return PORT_WAIT;
+    return -2;
+}
+
+
+/*
+ * Parse list of ports like "1,3-5" into bitmask.
+ * For compatibility, string of digits like "1234" (or "12") is treated
+ * as list of single digit ports: ports above 9 can only be given
+ * in list or range form, like "10,12" or "12-12".
+ * Returns bitmask of ports, or -1 if list is not valid.
+ */
+
+static int parse_ports(const char* str)
+{
+    int ports = 0;
+    const char* p = str;
+    size_t len = strlen(str);
+    if (len > 1 && strspn(str, "0123456789") == len) {
+        for (; *p; p++) {
+            if (*p == '0')
+                return -1;
+            ports |= 1 << (*p - '1');
         }
-        libusb_close(devh);
+        return ports;
     }
-    return rc;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        if (first < 1 || last > MAX_HUB_PORTS || first > last)
+            return -1;
+        for (; first <= last; first++)
+            ports |= 1 << (first-1);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return ports ? ports : -1;
 }
 
 
 /*
- * Assuming that devh is opened device handle for USB hub,
- * return state for given hub port.
- * In case of error, returns -1 (inspect errno for more information).
+ * Parse per-port actions like "1=on,2-3=off,4=cycle"
+ * into opt_port_actions[]. Only off, on and cycle are allowed.
+ * Returns bitmask of affected ports, or -1 if not valid.
  */
 
-static int get_port_status(struct libusb_device_handle *devh, int port)
+static int parse_port_actions(const char* str)
 {
-    int rc;
-    struct usb_port_status ust;
-    if (devh == NULL)
-        return -1;
+    int ports = 0;
+    int port;
+    for (port = 1; port <= MAX_HUB_PORTS; port++)
+        opt_port_actions[port-1] = POWER_KEEP;
+    while (*str) {
+        char buf[32] = "";
+        size_t len = strcspn(str, ",");
+        if (len >= sizeof(buf))
+            return -1;
+        memcpy(buf, str, len);
+        str += len;
+        if (*str == ',')
+            str++;
+        char* eq = strchr(buf, '=');
+        if (eq == NULL)
+            return -1;
+        *eq = 0;
+        int mask = parse_ports(buf);
+        int action = parse_action(eq + 1);
+        if (mask < 0 || action < POWER_OFF || action > POWER_CYCLE)
+            return -1;
+        for (port = 1; port <= MAX_HUB_PORTS; port++) {
+            if (mask & (1 << (port-1)))
+                opt_port_actions[port-1] = action;
+        }
+        ports |= mask;
+    }
+    return ports ? ports : -1;
+}
 
-    rc = libusb_control_transfer(devh,
-        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
-                           | LIBUSB_RECIPIENT_OTHER, /* port status */
-        LIBUSB_REQUEST_GET_STATUS, 0,
-        port, (unsigned char*)&ust, sizeof(ust),
-        USB_CTRL_GET_TIMEOUT
-    );
 
-    if (rc < 0) {
-        return rc;
+/*
+ * Find condition in port_conditions[] by name.
+ * Returns its index, or -1 if there is no such condition.
+ */
+
+static int find_condition(const char* name)
+{
+    int j;
+    for (j = 0; j < (int)(sizeof(port_conditions)/sizeof(port_conditions[0])); j++) {
+        if (!strcasecmp(name, port_conditions[j].name))
+            return j;
     }
-    return ust.wPortStatus;
+    return -1;
 }
 
 
 /*
- * Get USB device description as a string.
- *
- * It will use following format:
- *
- *    "<vid:pid> <vendor> <product> <serial>, <USB x.yz, N ports>"
- *
- * vid:pid will be always present, but vendor, product or serial
- * may be skipped if they are empty or not enough permissions to read them.
- * <USB x.yz, N ports> will be present only for USB hubs.
- *
- * returns 0 for success and error code for failure.
- * in case of failure description buffer is not altered.
+ * Parse predicate like "!connect", "power,!enable" or "oc|c_oc"
+ * into terms: terms separated by | (or), conditions separated
+ * by comma or & (and), each condition optionally negated with !.
+ * Returns number of terms, or -1 if predicate is invalid.
  */
 
-static int get_device_description(struct libusb_device * dev, char* description, int desc_len)
+static int parse_condition(const char* str, struct condition_term * terms)
 {
-    int rc;
-    int id_vendor  = 0;
-    int id_product = 0;
-    char vendor[64]  = "";
-    char product[64] = "";
-    char serial[64]  = "";
-    char ports[64]   = "";
-    struct libusb_device_descriptor desc;
-    struct libusb_device_handle *devh = NULL;
-    rc = libusb_get_device_descriptor(dev, &desc);
-    if (rc)
-        return rc;
-    id_vendor  = libusb_le16_to_cpu(desc.idVendor);
-    id_product = libusb_le16_to_cpu(desc.idProduct);
-    rc = libusb_open(dev, &devh);
-    if (rc == 0) {
-        if (desc.iManufacturer) {
-            libusb_get_string_descriptor_ascii(devh,
-                desc.iManufacturer, (unsigned char*)vendor, sizeof(vendor));
-            rtrim(vendor);
-        }
-        if (desc.iProduct) {
-            libusb_get_string_descriptor_ascii(devh,
-                desc.iProduct, (unsigned char*)product, sizeof(product));
-            rtrim(product);
-        }
-        if (desc.iSerialNumber) {
-            libusb_get_string_descriptor_ascii(devh,
-                desc.iSerialNumber, (unsigned char*)serial, sizeof(serial));
-            rtrim(serial);
-        }
-        if (desc.bDeviceClass == LIBUSB_CLASS_HUB) {
-            struct hub_info info;
-            rc = get_hub_info(dev, &info);
-            if (rc == 0) {
-                snprintf(ports, sizeof(ports), ", USB %x.%02x, %d ports",
-                   info.bcd_usb >> 8, info.bcd_usb & 0xFF, info.nports);
+    char buf[256];
+    char* term_end;
+    char* term = buf;
+    int count = 0;
+    snprintf(buf, sizeof(buf), "%s", str);
+    while (term != NULL) {
+        term_end = strchr(term, '|');
+        if (term_end != NULL)
+            *term_end++ = 0;
+        if (count >= MAX_WHERE_TERMS)
+            return -1;
+        int set = 0, clear = 0;
+        char* cond = strtok(term, ",& ");
+        if (cond == NULL)
+            return -1;
+        while (cond != NULL) {
+            int negate = 0;
+            int j;
+            while (*cond == '!') {
+                negate = !negate;
+                cond++;
             }
+            j = find_condition(cond);
+            if (j < 0)
+                return -1;
+            if (negate)
+                clear |= 1 << j;
+            else
+                set |= 1 << j;
+            cond = strtok(NULL, ",& ");
         }
-        libusb_close(devh);
+        terms[count].set   = set;
+        terms[count].clear = clear;
+        count++;
+        term = term_end;
+    }
+    return count;
+}
+
+
+/*
+ * Check if conditions given as bitmask of port_conditions[]
+ * match any of predicate terms.
+ */
+
+static int condition_match(int mask, const struct condition_term * terms,
+                           int count)
+{
+    int j;
+    for (j = 0; j < count; j++) {
+        if ((mask & terms[j].set) == terms[j].set && !(mask & terms[j].clear))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Parse device like "0403:6001", "/A10KZP45" or "0403:6001/A10KZP45"
+ * into device spec.
+ * Returns 0, or -1 if device is not valid.
+ */
+
+static int parse_device(const char* str, struct device_spec * device)
+{
+    const char* slash = strchr(str, '/');
+    device->vid = device->pid = -1;
+    device->serial[0] = 0;
+    if (slash != str) {
+        char* end;
+        if (!isxdigit((unsigned char)*str))
+            return -1;
+        device->vid = strtol(str, &end, 16);
+        if (*end != ':' || device->vid > 0xffff)
+            return -1;
+        str = end + 1;
+        if (!isxdigit((unsigned char)*str))
+            return -1;
+        device->pid = strtol(str, &end, 16);
+        if ((*end != 0 && *end != '/') || device->pid > 0xffff)
+            return -1;
+    }
+    if (slash != NULL) {
+        if (strlen(slash + 1) == 0 ||
+            strlen(slash + 1) >= sizeof(device->serial))
+            return -1;
+        strcpy(device->serial, slash + 1);
+    }
+    return 0;
+}
+
+
+/*
+ * Return action to perform on given port.
+ */
+
+static int port_action(int port)
+{
+    if (opt_action == POWER_MIXED)
+        return opt_port_actions[port-1];
+    if (opt_ports & (1 << (port-1)))
+        return opt_action;
+    return POWER_KEEP;
+}
+
+
+/*
+ * Return bitmask of ports to be switched in given phase
+ * of power action: k=0 for power off, k=1 for power on.
+ */
+
+static int phase_ports(int k)
+{
+    int ports = 0;
+    int port;
+    for (port = 1; port <= MAX_HUB_PORTS; port++) {
+        int action = port_action(port);
+        if (action == POWER_CYCLE || action == (k == 0 ? POWER_OFF : POWER_ON))
+            ports |= 1 << (port-1);
+    }
+    return ports;
+}
+
+
+/*
+ * Return bitmask of selected ports of given hub.
+ * When all ports are selected, non-removable ports are skipped:
+ * they have to be listed explicitly.
+ */
+
+static int hub_ports(struct hub_info * hub)
+{
+    int ports = opt_ports & ((1 << hub->nports) - 1);
+    if (opt_ports == ALL_HUB_PORTS)
+        ports &= ~hub->fixed_ports;
+    if (opt_where_count > 0)
+        ports &= hub->where_ports;
+    return ports;
+}
+
+
+/*
+ * Return bitmask of ports of given hub to be switched in given phase
+ * (k=0 for power off, k=1 for power on). Unlike phase_ports(),
+ * this also handles restore from snapshot, which is different per hub.
+ */
+
+static int hub_phase_ports(struct hub_info * hub, int k)
+{
+    if (opt_action == POWER_RESTORE) {
+        int all = ALL_HUB_PORTS & ((1 << hub->nports) - 1);
+        return (k == 0) ? all & ~hub->restore_power : hub->restore_power;
+    }
+    int ports = phase_ports(k) & ((1 << hub->nports) - 1);
+    if (opt_ports == ALL_HUB_PORTS)
+        ports &= ~hub->fixed_ports;
+    if (opt_where_count > 0)
+        ports &= hub->where_ports;
+    return ports;
+}
+
+
+/*
+ * Check if given hub is powered from port of upstream smart hub
+ * which is switched off in this run - then whole subtree behind
+ * that port loses power anyway, and hub itself does not need
+ * to be touched. Returns index of such upstream hub and sets
+ * *port, or returns -1.
+ */
+
+static int hub_cut_by(int i, int *port)
+{
+    struct libusb_device *dev = hubs[i].dev;
+    struct libusb_device *parent;
+    int j;
+    while ((parent = libusb_get_parent(dev)) != NULL) {
+        int p = libusb_get_port_number(dev);
+        for (j=0; j<hub_count; j++) {
+            if (hubs[j].dev != parent || !hubs[j].actionable)
+                continue;
+            if (hub_phase_ports(&hubs[j], 0) & (1 << (p-1))) {
+                *port = p;
+                return j;
+            }
+        }
+        dev = parent;
+    }
+    return -1;
+}
+
+
+/*
+ * Order hubs for given phase using their position in USB topology:
+ * downstream hubs first for power off (k=0), so that they are
+ * switched before losing upstream power, and upstream hubs first
+ * for power on (k=1), so that downstream hubs have power when
+ * they are switched. Hubs at the same depth keep enumeration order,
+ * and so do all hubs when only status is shown.
+ */
+
+static void plan_hub_order(int k, int *order)
+{
+    int depth[MAX_HUBS];
+    int i, j;
+    for (i=0; i<hub_count; i++) {
+        struct libusb_device *dev = hubs[i].dev;
+        depth[i] = 0;
+        while (opt_action != POWER_KEEP &&
+               (dev = libusb_get_parent(dev)) != NULL)
+        {
+            depth[i]++;
+        }
+        /* insertion sort, stable */
+        for (j=i; j>0; j--) {
+            int d = depth[order[j-1]];
+            if (k == 0 ? d >= depth[i] : d <= depth[i])
+                break;
+            order[j] = order[j-1];
+        }
+        order[j] = i;
+    }
+}
+
+
+/* trim trailing spaces from a string */
+
+static char* rtrim(char* str)
+{
+    int i;
+    for (i = strlen(str)-1; i>=0 && isspace(str[i]); i--) {
+        str[i] = 0;
+    }
+    return str;
+}
+
+
+/*
+ * Switch process to precise timing mode: real-time scheduling priority,
+ * memory locked in RAM and pinned to current CPU, so that power timing
+ * is not disturbed by other load. Failures are reported, but not fatal.
+ */
+
+static void setup_realtime()
+{
+#if defined(__linux__) || defined(__FreeBSD__)
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        perror("Cannot set real-time priority");
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("Cannot lock memory");
+    }
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            perror("Cannot pin to CPU");
+        }
+    }
+#endif
+#elif defined(_WIN32)
+    if (!SetPriorityClass(GetCurrentProcess(), REALTIME_PRIORITY_CLASS) ||
+        !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+    {
+        fprintf(stderr, "Cannot set real-time priority\n");
+    }
+    SetThreadAffinityMask(GetCurrentThread(), 1);
+#else
+    fprintf(stderr, "Real-time priority is not supported on this platform\n");
+#endif
+}
+
+
+/*
+ * Find hub (index in hubs[]) for opened device handle, or return -1.
+ */
+
+static int find_hub(struct libusb_device_handle *devh)
+{
+    int i;
+    for (i=0; i<hub_count; i++) {
+        if (hubs[i].dev == libusb_get_device(devh))
+            return i;
+    }
+    return -1;
+}
+
+
+/*
+ * Print request which would be sent in dry run mode,
+ * preceded by sleeps which would be paid before it.
+ * port is 0 for hub feature requests, feature is -1 for requests
+ * without feature (like device reset).
+ */
+
+static void dry_run_print(struct libusb_device_handle *devh, const char *request,
+                          int port, int feature)
+{
+    static const char * const port_features[] = {
+        [USB_PORT_FEAT_SUSPEND]        = "PORT_SUSPEND",
+        [USB_PORT_FEAT_RESET]          = "PORT_RESET",
+        [USB_PORT_FEAT_LINK_STATE]     = "PORT_LINK_STATE",
+        [USB_PORT_FEAT_POWER]          = "PORT_POWER",
+        [USB_PORT_FEAT_C_CONNECTION]   = "C_PORT_CONNECTION",
+        [USB_PORT_FEAT_C_ENABLE]       = "C_PORT_ENABLE",
+        [USB_PORT_FEAT_C_SUSPEND]      = "C_PORT_SUSPEND",
+        [USB_PORT_FEAT_C_OVER_CURRENT] = "C_PORT_OVER_CURRENT",
+        [USB_PORT_FEAT_C_RESET]        = "C_PORT_RESET",
+        [USB_PORT_FEAT_U1_TIMEOUT]     = "PORT_U1_TIMEOUT",
+        [USB_PORT_FEAT_U2_TIMEOUT]     = "PORT_U2_TIMEOUT",
+        [USB_PORT_FEAT_C_LINK_STATE]   = "C_PORT_LINK_STATE",
+        [USB_PORT_FEAT_C_CONFIG_ERROR] = "C_PORT_CONFIG_ERROR",
+        [USB_PORT_FEAT_BH_PORT_RESET]  = "BH_PORT_RESET",
+        [USB_PORT_FEAT_C_BH_PORT_RESET]= "C_BH_PORT_RESET",
+    };
+    static const char * const hub_features[] = {
+        [C_HUB_LOCAL_POWER]  = "C_HUB_LOCAL_POWER",
+        [C_HUB_OVER_CURRENT] = "C_HUB_OVER_CURRENT",
+    };
+    const char * name = NULL;
+    const char * location = "?";
+    int i = devh ? find_hub(devh) : -1;
+    if (port == 0 && feature >= 0 &&
+        feature < (int)(sizeof(hub_features)/sizeof(hub_features[0])))
+    {
+        name = hub_features[feature];
+    } else if (port != 0 && feature >= 0 &&
+        feature < (int)(sizeof(port_features)/sizeof(port_features[0])))
+    {
+        name = port_features[feature];
+    }
+    if (i >= 0)
+        location = hubs[i].location;
+    if (dry_run_pending > 0) {
+        printf("  [%10.3f ms] sleep %.3f ms\n",
+            (time_us() - dry_run_pending - dry_run_t0) / 1000.0,
+            dry_run_pending / 1000.0);
+        dry_run_pending = 0;
+    }
+    if (request == NULL)
+        return;
+    dry_run_requests++;
+    printf("  [%10.3f ms] hub %s: %s", (time_us() - dry_run_t0) / 1000.0,
+        location, request);
+    if (name != NULL)
+        printf(" %s", name);
+    else if (feature >= 0)
+        printf(" %d", feature);
+    if (port != 0) {
+        printf(" port %d", port & 0xff);
+        if (port >> 8)
+            printf(" value %d", port >> 8);
+    }
+    printf("\n");
+}
+
+
+/*
+ * Check if libusb error is transient, so that request is worth retrying.
+ * Errors like LIBUSB_ERROR_NO_DEVICE or LIBUSB_ERROR_ACCESS will not
+ * go away by themselves.
+ */
+
+static int is_transient_error(int rc)
+{
+    return rc == LIBUSB_ERROR_TIMEOUT     ||
+           rc == LIBUSB_ERROR_PIPE        || /* stall */
+           rc == LIBUSB_ERROR_BUSY        ||
+           rc == LIBUSB_ERROR_INTERRUPTED ||
+           rc == LIBUSB_ERROR_IO;
+}
+
+
+/*
+ * Send SET_FEATURE (set=1) or CLEAR_FEATURE (set=0) request
+ * for given hub port. Transient failures are retried with backoff.
+ * Outcome is recorded for the port, see report_port_errors().
+ * Returns libusb error code in case of failure.
+ */
+
+static int set_port_feature(struct libusb_device_handle *devh, int port,
+                            int feature, int set)
+{
+    int request = set ? LIBUSB_REQUEST_SET_FEATURE
+                      : LIBUSB_REQUEST_CLEAR_FEATURE;
+    if (opt_dry_run) {
+        dry_run_print(devh, set ? "SET_FEATURE" : "CLEAR_FEATURE",
+                      port, feature);
+        int i = find_hub(devh);
+        if (i >= 0 && feature == USB_PORT_FEAT_POWER) {
+            /* remember new state, so that further decisions follow it */
+            hubs[i].dry_run_set |= 1 << (port-1);
+            hubs[i].dry_run_power &= ~(1 << (port-1));
+            hubs[i].dry_run_power |= set << (port-1);
+        }
+        return 0;
+    }
+    int rc;
+    int attempt = 0;
+    int wait = CONTROL_RETRY_WAIT;
+    for (;;) {
+        attempt++;
+        rc = libusb_control_transfer(devh,
+            LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
+            request, feature,
+            port, NULL, 0, USB_CTRL_GET_TIMEOUT
+        );
+        if (rc >= 0 || !is_transient_error(rc) || attempt > CONTROL_RETRIES)
+            break;
+        sleep_ms(wait);
+        wait *= 2;
+    }
+    int i = find_hub(devh);
+    int p = port & 0xff; /* upper byte may carry feature value */
+    if (i >= 0 && p <= MAX_HUB_PORTS) {
+        hubs[i].port_error[p] = rc < 0 ? rc : 0;
+        hubs[i].port_attempts[p] = attempt;
+    }
+    return rc;
+}
+
+
+/*
+ * Send request to turn power on (SET_FEATURE) or off (CLEAR_FEATURE)
+ * for given hub port. Returns libusb error code in case of failure.
+ */
+
+static int set_port_power(struct libusb_device_handle *devh, int port, int on)
+{
+    return set_port_feature(devh, port, USB_PORT_FEAT_POWER, on);
+}
+
+
+/*
+ * Check if location is present in comma separated list of locations.
+ */
+
+static int location_match(const char* list, const char* location)
+{
+    size_t len = strlen(location);
+    const char* p = list;
+    while (p != NULL) {
+        if (strncasecmp(p, location, len) == 0 &&
+            (p[len] == 0 || p[len] == ','))
+        {
+            return 1;
+        }
+        p = strchr(p, ',');
+        if (p != NULL)
+            p++;
+    }
+    return 0;
+}
+
+
+/*
+ * get USB hub properties.
+ * most hub_info fields are filled, except for description.
+ * returns 0 for success and error code for failure.
+ */
+
+static int get_hub_info(struct libusb_device *dev, struct hub_info *info)
+{
+    int rc = 0;
+    int len = 0;
+    struct libusb_device_handle *devh = NULL;
+    /* DeviceRemovable and PortPwrCtrlMask have 1 bit per port (USB2) */
+    unsigned char buf[LIBUSB_DT_HUB_NONVAR_SIZE + 2 * 32] = {0};
+    struct usb_hub_descriptor *uhd = (struct usb_hub_descriptor *)buf;
+    int minlen = LIBUSB_DT_HUB_NONVAR_SIZE + 2;
+    struct libusb_device_descriptor desc;
+    rc = libusb_get_device_descriptor(dev, &desc);
+    if (rc)
+        return rc;
+    if (desc.bDeviceClass != LIBUSB_CLASS_HUB)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    int bcd_usb = libusb_le16_to_cpu(desc.bcdUSB);
+    int desc_type = bcd_usb >= USB_SS_BCD ? LIBUSB_DT_SUPERSPEED_HUB
+                                          : LIBUSB_DT_HUB;
+    rc = libusb_open(dev, &devh);
+    if (rc == 0) {
+        len = libusb_control_transfer(devh,
+            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
+                               | LIBUSB_RECIPIENT_DEVICE, /* hub status */
+            LIBUSB_REQUEST_GET_DESCRIPTOR,
+            desc_type << 8,
+            0,
+            buf, sizeof(buf),
+            USB_CTRL_GET_TIMEOUT
+        );
+
+        if (len >= minlen) {
+            unsigned char port_numbers[MAX_HUB_CHAIN] = {0};
+            info->dev     = dev;
+            info->bcd_usb = bcd_usb;
+            info->nports  = uhd->bNbrPorts;
+            info->pwr_on_2_good = uhd->bPwrOn2PwrGood * 2;
+            info->contr_current = uhd->bHubContrCurrent;
+            snprintf(
+                info->vendor, sizeof(info->vendor),
+                "%04x:%04x",
+                libusb_le16_to_cpu(desc.idVendor),
+                libusb_le16_to_cpu(desc.idProduct)
+            );
+
+            /* Convert bus and ports array into USB location string */
+            int bus = libusb_get_bus_number(dev);
+            snprintf(info->location, sizeof(info->location), "%d", bus);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+            /*
+             * libusb_get_port_path is deprecated since libusb v1.0.16,
+             * therefore use libusb_get_port_numbers when supported
+             */
+            int pcount = libusb_get_port_numbers(dev, port_numbers, MAX_HUB_CHAIN);
+#else
+            int pcount = libusb_get_port_path(NULL, dev, port_numbers, MAX_HUB_CHAIN);
+#endif
+            int k;
+            for (k=0; k<pcount; k++) {
+                char s[8];
+                snprintf(s, sizeof(s), "%s%d", k==0 ? "-" : ".", port_numbers[k]);
+                strcat(info->location, s);
+            }
+
+            /* DeviceRemovable: bit N is set if port N is non-removable */
+            info->fixed_ports = 0;
+            int offset = desc_type == LIBUSB_DT_SUPERSPEED_HUB
+                         ? 3 /* after bHubHdrDecLat and wHubDelay */
+                         : 0;
+            int port;
+            for (port = 1; port <= info->nports && port <= MAX_HUB_PORTS; port++) {
+                int byte = LIBUSB_DT_HUB_NONVAR_SIZE + offset + port / 8;
+                if (byte < len && (buf[byte] & (1 << (port % 8))))
+                    info->fixed_ports |= 1 << (port-1);
+            }
+
+            info->ppps = 0;
+            /* Logical Power Switching Mode */
+            int lpsm = uhd->wHubCharacteristics[0] & HUB_CHAR_LPSM;
+            /* Over-Current Protection Mode */
+            int ocpm = uhd->wHubCharacteristics[0] & HUB_CHAR_OCPM;
+            /* LPSM must be supported per-port, and OCPM per port or ganged */
+            if ((lpsm == HUB_CHAR_INDV_PORT_LPSM) &&
+                (ocpm == HUB_CHAR_INDV_PORT_OCPM ||
+                 ocpm == HUB_CHAR_COMMON_OCPM))
+            {
+                info->ppps = 1;
+            }
+        } else {
+            rc = len;
+        }
+        libusb_close(devh);
+    }
+    return rc;
+}
+
+
+/*
+ * Return wPortStatus bit which is set when port of given hub
+ * is powered: USB3 hubs have it in different place than USB2 hubs.
+ */
+
+static int port_power_mask(const struct hub_info * hub)
+{
+    return hub->bcd_usb < USB_SS_BCD ? USB_PORT_STAT_POWER
+                                     : USB_SS_PORT_STAT_POWER;
+}
+
+
+/*
+ * Assuming that devh is opened device handle for USB hub,
+ * return state for given hub port, and store port change bits
+ * into *change unless it is NULL.
+ * In case of error, returns -1 (inspect errno for more information).
+ */
+
+static int get_port_status_change(struct libusb_device_handle *devh, int port,
+                                  int *change)
+{
+    int rc;
+    struct usb_port_status ust;
+    if (devh == NULL)
+        return -1;
+
+    rc = libusb_control_transfer(devh,
+        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
+                           | LIBUSB_RECIPIENT_OTHER, /* port status */
+        LIBUSB_REQUEST_GET_STATUS, 0,
+        port, (unsigned char*)&ust, sizeof(ust),
+        USB_CTRL_GET_TIMEOUT
+    );
+
+    if (rc < 0) {
+        return rc;
+    }
+    if (change != NULL)
+        *change = ust.wPortChange & 0xffff;
+    int i = opt_dry_run ? find_hub(devh) : -1;
+    if (i >= 0 && (hubs[i].dry_run_set & (1 << (port-1)))) {
+        /* port as it would be after simulated power switching */
+        int power_mask = port_power_mask(&hubs[i]);
+        if (hubs[i].dry_run_power & (1 << (port-1)))
+            return ust.wPortStatus | power_mask;
+        return hubs[i].bcd_usb < USB_SS_BCD ? 0 : USB_SS_PORT_LS_SS_DISABLED;
+    }
+    return ust.wPortStatus;
+}
+
+
+static int get_port_status(struct libusb_device_handle *devh, int port)
+{
+    return get_port_status_change(devh, port, NULL);
+}
+
+
+/*
+ * Assuming that devh is opened device handle for USB hub,
+ * return hub-wide status, and store hub change bits into *change.
+ * In case of error, returns libusb error code.
+ */
+
+static int get_hub_status(struct libusb_device_handle *devh, int *change)
+{
+    int rc;
+    struct usb_port_status ust; /* wHubStatus/wHubChange have same layout */
+    rc = libusb_control_transfer(devh,
+        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
+                           | LIBUSB_RECIPIENT_DEVICE, /* hub status */
+        LIBUSB_REQUEST_GET_STATUS, 0,
+        0, (unsigned char*)&ust, sizeof(ust),
+        USB_CTRL_GET_TIMEOUT
+    );
+    if (rc < 0)
+        return rc;
+    *change = ust.wPortChange & 0xffff;
+    return ust.wPortStatus & 0xffff;
+}
+
+
+/*
+ * Clear hub change bits given in change mask (as read by get_hub_status).
+ */
+
+static int clear_hub_changes(struct libusb_device_handle *devh, int change)
+{
+    static const struct {
+        int bit;
+        int feature;
+    } c_features[] = {
+        { HUB_CHANGE_LOCAL_POWER, C_HUB_LOCAL_POWER  },
+        { HUB_CHANGE_OVERCURRENT, C_HUB_OVER_CURRENT },
+    };
+    int rc = 0;
+    unsigned i;
+    for (i = 0; i < sizeof(c_features)/sizeof(c_features[0]) && rc >= 0; i++) {
+        if (!(change & c_features[i].bit))
+            continue;
+        if (opt_dry_run) {
+            dry_run_print(devh, "CLEAR_FEATURE", 0, c_features[i].feature);
+            continue;
+        }
+        rc = libusb_control_transfer(devh,
+            LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_DEVICE,
+            LIBUSB_REQUEST_CLEAR_FEATURE, c_features[i].feature,
+            0, NULL, 0, USB_CTRL_GET_TIMEOUT
+        );
+    }
+    return rc;
+}
+
+
+/*
+ * Clear port change bits given in change mask (as read by
+ * get_port_status_change), so that only events which happen
+ * after that read will be reported next time.
+ */
+
+static int clear_port_changes(struct libusb_device_handle *devh, int port,
+                              int change)
+{
+    static const struct {
+        int bit;
+        int feature;
+    } c_features[] = {
+        { USB_PORT_STAT_C_CONNECTION,   USB_PORT_FEAT_C_CONNECTION    },
+        { USB_PORT_STAT_C_ENABLE,       USB_PORT_FEAT_C_ENABLE        },
+        { USB_PORT_STAT_C_SUSPEND,      USB_PORT_FEAT_C_SUSPEND       },
+        { USB_PORT_STAT_C_OVERCURRENT,  USB_PORT_FEAT_C_OVER_CURRENT  },
+        { USB_PORT_STAT_C_RESET,        USB_PORT_FEAT_C_RESET         },
+        { USB_PORT_STAT_C_BH_RESET,     USB_PORT_FEAT_C_BH_PORT_RESET },
+        { USB_PORT_STAT_C_LINK_STATE,   USB_PORT_FEAT_C_LINK_STATE    },
+        { USB_PORT_STAT_C_CONFIG_ERROR, USB_PORT_FEAT_C_CONFIG_ERROR  },
+    };
+    int rc = 0;
+    unsigned i;
+    for (i = 0; i < sizeof(c_features)/sizeof(c_features[0]); i++) {
+        if (!(change & c_features[i].bit))
+            continue;
+        if (set_port_feature(devh, port, c_features[i].feature, 0) < 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+
+/*
+ * Reset device attached to given hub port with libusb_reset_device(),
+ * so that OS does port reset (warm reset for USB3 hub) and restores
+ * device address and configuration. Device which comes back as
+ * different one is re-enumerated by OS, which is fine too.
+ * Returns time in microseconds it took, or libusb error code
+ * (LIBUSB_ERROR_NOT_FOUND if no enumerated device is on the port).
+ */
+
+static int reset_port(struct libusb_device_handle *devh,
+                      struct hub_info * hub, int port)
+{
+    struct libusb_device * udev;
+    struct libusb_device_handle * udevh = NULL;
+    int64_t start = time_us();
+    int i = 0;
+    while ((udev = usb_devs[i++]) != NULL) {
+        if (libusb_get_parent(udev) == hub->dev &&
+            libusb_get_port_number(udev) == port)
+            break;
+    }
+    if (udev == NULL)
+        return LIBUSB_ERROR_NOT_FOUND;
+    if (opt_dry_run) {
+        dry_run_print(devh, "USB_RESET", port, -1);
+        return 0;
+    }
+    int rc = libusb_open(udev, &udevh);
+    if (rc < 0)
+        return rc;
+    rc = libusb_reset_device(udevh);
+    libusb_close(udevh);
+    if (rc < 0 && rc != LIBUSB_ERROR_NOT_FOUND)
+        return rc;
+    return (int)(time_us() - start);
+}
+
+
+/*
+ * Get USB device description as a string.
+ *
+ * It will use following format:
+ *
+ *    "<vid:pid> <vendor> <product> <serial>, <USB x.yz, N ports>"
+ *
+ * vid:pid will be always present, but vendor, product or serial
+ * may be skipped if they are empty or not enough permissions to read them.
+ * <USB x.yz, N ports> will be present only for USB hubs.
+ *
+ * returns 0 for success and error code for failure.
+ * in case of failure description buffer is not altered.
+ */
+
+static int get_device_description(struct libusb_device * dev, char* description, int desc_len)
+{
+    int rc;
+    int id_vendor  = 0;
+    int id_product = 0;
+    char vendor[64]  = "";
+    char product[64] = "";
+    char serial[64]  = "";
+    char ports[64]   = "";
+    struct libusb_device_descriptor desc;
+    struct libusb_device_handle *devh = NULL;
+    rc = libusb_get_device_descriptor(dev, &desc);
+    if (rc)
+        return rc;
+    id_vendor  = libusb_le16_to_cpu(desc.idVendor);
+    id_product = libusb_le16_to_cpu(desc.idProduct);
+    rc = libusb_open(dev, &devh);
+    if (rc == 0) {
+        if (desc.iManufacturer) {
+            libusb_get_string_descriptor_ascii(devh,
+                desc.iManufacturer, (unsigned char*)vendor, sizeof(vendor));
+            rtrim(vendor);
+        }
+        if (desc.iProduct) {
+            libusb_get_string_descriptor_ascii(devh,
+                desc.iProduct, (unsigned char*)product, sizeof(product));
+            rtrim(product);
+        }
+        if (desc.iSerialNumber) {
+            libusb_get_string_descriptor_ascii(devh,
+                desc.iSerialNumber, (unsigned char*)serial, sizeof(serial));
+            rtrim(serial);
+        }
+        if (desc.bDeviceClass == LIBUSB_CLASS_HUB) {
+            struct hub_info info;
+            rc = get_hub_info(dev, &info);
+            if (rc == 0) {
+                snprintf(ports, sizeof(ports), ", USB %x.%02x, %d ports",
+                   info.bcd_usb >> 8, info.bcd_usb & 0xFF, info.nports);
+            }
+        }
+        libusb_close(devh);
+    }
+    snprintf(description, desc_len,
+        "%04x:%04x%s%s%s%s%s%s%s",
+        id_vendor, id_product,
+        vendor[0]  ? " " : "", vendor,
+        product[0] ? " " : "", product,
+        serial[0]  ? " " : "", serial,
+        ports
+    );
+    return 0;
+}
+
+
+/*
+ * Find sublink speed with given ID in SuperSpeedPlus capability
+ * of device (see USB 3.1 spec Table 9-19), or fastest of all sublink
+ * speeds if ssid is -1.
+ * Returns speed in Mbps, or 0 if it is unknown.
+ */
+
+static int get_sublink_speed(struct libusb_device_handle *devh, int ssid)
+{
+    int mbps = 0;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    struct libusb_bos_descriptor *bos;
+    int i, j;
+    if (libusb_get_bos_descriptor(devh, &bos) != 0)
+        return 0;
+    for (i = 0; i < bos->bNumDeviceCaps && (ssid < 0 || mbps == 0); i++) {
+        struct libusb_bos_dev_capability_descriptor *cap = bos->dev_capability[i];
+        if (cap->bDevCapabilityType != USB_BT_SUPERSPEED_PLUS || cap->bLength < 16)
+            continue;
+        /* dev_capability_data starts with bReserved, then bmAttributes */
+        const unsigned char *data = cap->dev_capability_data;
+        int count = (data[1] & 0x1f) + 1;
+        for (j = 0; j < count && 12 + 4*j + 4 <= cap->bLength; j++) {
+            const unsigned char *attr = data + 9 + 4*j;
+            int lse = (attr[0] >> 4) & 0x03;   /* b/s, Kb/s, Mb/s, Gb/s */
+            int lsm = attr[2] | (attr[3] << 8);
+            int speed = lse == 3 ? lsm * 1000 : lse == 2 ? lsm : 0;
+            if (ssid < 0) {
+                if (speed > mbps)
+                    mbps = speed;
+                continue;
+            }
+            if ((attr[0] & 0x0f) != ssid)
+                continue;
+            mbps = speed;
+            break;
+        }
+    }
+    libusb_free_bos_descriptor(bos);
+#else
+    (void)devh;
+    (void)ssid;
+#endif
+    return mbps;
+}
+
+
+/*
+ * Check if device lists capability of given type in its BOS descriptor.
+ * Returns 1 if it does, or 0 if it does not (or if it cannot be read).
+ */
+
+static int has_capability(struct libusb_device_handle *devh, int type)
+{
+    int found = 0;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    struct libusb_bos_descriptor *bos;
+    int i;
+    if (libusb_get_bos_descriptor(devh, &bos) != 0)
+        return 0;
+    for (i = 0; i < bos->bNumDeviceCaps; i++) {
+        if (bos->dev_capability[i]->bDevCapabilityType == type)
+            found = 1;
+    }
+    libusb_free_bos_descriptor(bos);
+#else
+    (void)devh;
+    (void)type;
+#endif
+    return found;
+}
+
+
+/*
+ * Check if device has negotiated lower link speed than it supports,
+ * e.g. USB3 device connected at USB2 speed, or high speed device
+ * connected at full speed.
+ * Returns name of best speed device supports if link is degraded,
+ * or NULL if it is not (or if speed cannot be determined).
+ */
+
+static const char* get_degraded_speed(struct libusb_device * dev)
+{
+    struct libusb_device_descriptor desc;
+    struct libusb_device_handle *devh = NULL;
+    const char* best = NULL;
+    int speed = libusb_get_device_speed(dev);
+    if (speed == LIBUSB_SPEED_UNKNOWN)
+        return NULL;
+    if (libusb_get_device_descriptor(dev, &desc) != 0)
+        return NULL;
+    int bcd = libusb_le16_to_cpu(desc.bcdUSB);
+    if (bcd >= 0x0201 && speed <= LIBUSB_SPEED_HIGH) {
+        /* USB3 device at USB2 speed reports bcdUSB 2.10, so look at BOS */
+        if (libusb_open(dev, &devh) == 0) {
+            if (get_sublink_speed(devh, -1) >= 10000)
+                best = "10gbps";
+            else if (has_capability(devh, USB_BT_SUPERSPEED) ||
+                     has_capability(devh, USB_BT_SUPERSPEED_PLUS))
+                best = "5gbps";
+            libusb_close(devh);
+        }
+        if (best != NULL)
+            return best;
+    }
+    if (bcd >= USB_SS_BCD && speed < LIBUSB_SPEED_SUPER)
+        return "5gbps";
+    if (bcd >= 0x0200 && speed == LIBUSB_SPEED_FULL) {
+        /* only high speed capable devices have device qualifier */
+        unsigned char buf[10];
+        if (libusb_open(dev, &devh) == 0) {
+            if (libusb_get_descriptor(devh, USB_DT_DEVICE_QUALIFIER, 0,
+                                      buf, sizeof(buf)) > 0)
+            {
+                best = "highspeed";
+            }
+            libusb_close(devh);
+        }
+    }
+    if (bcd >= USB_SSP_BCD && speed == LIBUSB_SPEED_SUPER) {
+        if (libusb_open(dev, &devh) == 0) {
+            /* SuperSpeedPlus device lists its sublink speeds */
+            if (get_sublink_speed(devh, -1) >= 10000)
+                best = "10gbps";
+            libusb_close(devh);
+        }
+    }
+    return best;
+}
+
+
+/*
+ * show status for hub ports
+ * portmask is bitmap of ports to display
+ * if portmask is 0, show all ports
+ * devh is hub handle already opened by caller, or NULL
+ */
+
+static int print_port_status(struct hub_info * hub,
+                             struct libusb_device_handle * devh, int portmask)
+{
+    int port_status;
+    struct libusb_device_handle * opened = NULL;
+    int rc = 0;
+    struct libusb_device *dev = hub->dev;
+    if (devh == NULL) {
+        rc = libusb_open(dev, &opened);
+        devh = opened;
+    }
+    if (rc == 0) {
+        /* hub-wide conditions are shown only if something is wrong */
+        int hub_change = 0;
+        int hub_status = get_hub_status(devh, &hub_change);
+        if (hub_status > 0 || hub_change > 0) {
+            printf("  Hub: %04x.%04x", hub_status, hub_change);
+            if (hub_status & HUB_STATUS_LOCAL_POWER) printf(" nolocalpower");
+            if (hub_status & HUB_STATUS_OVERCURRENT) printf(" oc");
+            if (hub_change & HUB_CHANGE_LOCAL_POWER) printf(" c_localpower");
+            if (hub_change & HUB_CHANGE_OVERCURRENT) printf(" c_oc");
+            printf("\n");
+            if (opt_clear && !hub->changes_cleared && hub_change > 0 &&
+                clear_hub_changes(devh, hub_change) < 0)
+            {
+                fprintf(stderr,
+                    "cannot clear hub changes, %s (%d)\n",
+                    strerror(errno), errno);
+            }
+        }
+        int port;
+        for (port = 1; port <= hub->nports; port++) {
+            if (portmask > 0 && (portmask & (1 << (port-1))) == 0) continue;
+
+            int change = 0;
+            port_status = get_port_status_change(devh, port, &change);
+            if (port_status == -1) {
+                fprintf(stderr,
+                    "cannot read port %d status, %s (%d)\n",
+                    port, strerror(errno), errno);
+                break;
+            }
+            if (opt_clear && !hub->changes_cleared && change) {
+                if (clear_port_changes(devh, port, change) < 0) {
+                    fprintf(stderr,
+                        "cannot clear port %d changes, %s (%d)\n",
+                        port, strerror(errno), errno);
+                }
+            }
+
+            printf("  Port %d: %04x", port, port_status);
+
+            char description[256] = "";
+            struct libusb_device * udev;
+            int i = 0;
+            while ((udev = usb_devs[i++]) != NULL) {
+                if (libusb_get_parent(udev)      == dev &&
+                    libusb_get_port_number(udev) == port)
+                {
+                    rc = get_device_description(udev, description, sizeof(description));
+                    if (rc == 0)
+                        break;
+                }
+            }
+
+            /* USB 3.1 hub reports actual SuperSpeedPlus link rate */
+            int link_mbps = 0;
+            if (hub->bcd_usb >= USB_SSP_BCD &&
+                (port_status & USB_PORT_STAT_ENABLE))
+            {
+                unsigned char ext[8];
+                rc = libusb_control_transfer(devh,
+                    LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
+                                       | LIBUSB_RECIPIENT_OTHER,
+                    LIBUSB_REQUEST_GET_STATUS, USB_PORT_EXT_STATUS,
+                    port, ext, sizeof(ext), USB_CTRL_GET_TIMEOUT
+                );
+                if (rc == sizeof(ext)) {
+                    int ext_status = ext[4] | (ext[5] << 8);
+                    link_mbps = get_sublink_speed(devh,
+                                    USB_EXT_PORT_RX_SSID(ext_status))
+                              * USB_EXT_PORT_RX_LANES(ext_status);
+                }
+            }
+
+            if (hub->bcd_usb < USB_SS_BCD) {
+                if (port_status == 0) {
+                    printf(" off");
+                } else {
+                    if (port_status & USB_PORT_STAT_POWER)        printf(" power");
+                    if (port_status & USB_PORT_STAT_INDICATOR)    printf(" indicator");
+                    if (port_status & USB_PORT_STAT_TEST)         printf(" test");
+                    if (port_status & USB_PORT_STAT_HIGH_SPEED)   printf(" highspeed");
+                    if (port_status & USB_PORT_STAT_LOW_SPEED)    printf(" lowspeed");
+                    if (port_status & USB_PORT_STAT_SUSPEND)      printf(" suspend");
+                }
+            } else {
+                if (port_status == USB_SS_PORT_LS_SS_DISABLED) {
+                    printf(" off");
+                } else {
+                    int link_state = port_status & USB_PORT_STAT_LINK_STATE;
+                    if (port_status & USB_SS_PORT_STAT_POWER)     printf(" power");
+                    if ((port_status & USB_SS_PORT_STAT_SPEED)
+                         == USB_PORT_STAT_SPEED_5GBPS)
+                    {
+                        if (link_mbps > 5000)
+                            printf(" %dgbps", link_mbps / 1000);
+                        else
+                            printf(" 5gbps");
+                    }
+                    if (link_state == USB_SS_PORT_LS_U0)          printf(" U0");
+                    if (link_state == USB_SS_PORT_LS_U1)          printf(" U1");
+                    if (link_state == USB_SS_PORT_LS_U2)          printf(" U2");
+                    if (link_state == USB_SS_PORT_LS_U3)          printf(" U3");
+                    if (link_state == USB_SS_PORT_LS_SS_DISABLED) printf(" SS.Disabled");
+                    if (link_state == USB_SS_PORT_LS_RX_DETECT)   printf(" Rx.Detect");
+                    if (link_state == USB_SS_PORT_LS_SS_INACTIVE) printf(" SS.Inactive");
+                    if (link_state == USB_SS_PORT_LS_POLLING)     printf(" Polling");
+                    if (link_state == USB_SS_PORT_LS_RECOVERY)    printf(" Recovery");
+                    if (link_state == USB_SS_PORT_LS_HOT_RESET)   printf(" HotReset");
+                    if (link_state == USB_SS_PORT_LS_COMP_MOD)    printf(" Compliance");
+                    if (link_state == USB_SS_PORT_LS_LOOPBACK)    printf(" Loopback");
+                }
+            }
+            if (port_status & USB_PORT_STAT_RESET)       printf(" reset");
+            if (port_status & USB_PORT_STAT_OVERCURRENT) printf(" oc");
+            if (port_status & USB_PORT_STAT_ENABLE)      printf(" enable");
+            if (port_status & USB_PORT_STAT_CONNECTION)  printf(" connect");
+            if (hub->fixed_ports & (1 << (port-1)))      printf(" nonremovable");
+            if (udev != NULL) {
+                const char* best = get_degraded_speed(udev);
+                if (best != NULL)
+                    printf(" degraded(%s)", best);
+            }
+
+            /* events latched by hub since change bits were last cleared */
+            if (change & USB_PORT_STAT_C_CONNECTION)     printf(" c_connect");
+            if (change & USB_PORT_STAT_C_ENABLE)         printf(" c_enable");
+            if (change & USB_PORT_STAT_C_SUSPEND)        printf(" c_suspend");
+            if (change & USB_PORT_STAT_C_OVERCURRENT)    printf(" c_oc");
+            if (change & USB_PORT_STAT_C_RESET)          printf(" c_reset");
+            if (hub->bcd_usb >= USB_SS_BCD) {
+                if (change & USB_PORT_STAT_C_BH_RESET)     printf(" c_bh_reset");
+                if (change & USB_PORT_STAT_C_LINK_STATE)   printf(" c_link_state");
+                if (change & USB_PORT_STAT_C_CONFIG_ERROR) printf(" c_config_error");
+            }
+
+            if (port_status & USB_PORT_STAT_CONNECTION)  printf(" [%s]", description);
+
+            printf("\n");
+        }
+        /* changes seen later were caused by our own action */
+        if (opt_clear)
+            hub->changes_cleared = 1;
+        if (opened != NULL)
+            libusb_close(opened);
+    }
+    return 0;
+}
+
+
+/*
+ * Print status of given ports of hub (all ports if portmask is 0),
+ * with header saying whether it is current status or new one.
+ * devh is hub handle already opened by caller, or NULL.
+ */
+
+static void print_hub_status(const char* when, struct hub_info * hub,
+                             struct libusb_device_handle * devh, int portmask)
+{
+    printf("%s status for hub %s [%s]\n", when, hub->location, hub->description);
+    print_port_status(hub, devh, portmask);
+}
+
+
+/*
+ * Reset hub (-R), causing all devices behind it to reassociate.
+ * Returns 0 on success or libusb error code.
+ */
+
+static int reset_hub(struct libusb_device_handle *devh)
+{
+    printf("Resetting hub...\n");
+    if (opt_dry_run)
+        dry_run_print(devh, "USB_RESET", 0, -1);
+    int rc = opt_dry_run ? 0 : libusb_reset_device(devh);
+    if (rc < 0) {
+        perror("Reset failed!\n");
+    } else {
+        printf("Reset successful!\n");
+    }
+    return rc;
+}
+
+
+/*
+ * Open all actionable hubs into devhs[].
+ */
+
+static void open_hubs(struct libusb_device_handle ** devhs)
+{
+    int i;
+    for (i=0; i<hub_count; i++) {
+        devhs[i] = NULL;
+        if (hubs[i].actionable && libusb_open(hubs[i].dev, &devhs[i]) != 0) {
+            fprintf(stderr, "Cannot open hub %s\n", hubs[i].location);
+            devhs[i] = NULL;
+        }
+    }
+}
+
+
+/*
+ * Close hubs opened with open_hubs(), showing their new status first
+ * if show_status is set.
+ */
+
+static void close_hubs(struct libusb_device_handle ** devhs, int show_status)
+{
+    int i;
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] == NULL)
+            continue;
+        if (show_status)
+            print_hub_status("New", &hubs[i], devhs[i], opt_ports);
+        libusb_close(devhs[i]);
+        devhs[i] = NULL;
+    }
+}
+
+
+/*
+ * Estimate current in mA drawn by device on given hub port.
+ * Uses bMaxPower of attached device (looking at USB2/USB3 dual hub too)
+ * if it was enumerated, otherwise assumes one unit load.
+ */
+
+static int get_port_current(struct hub_info * hub, int port)
+{
+    int current = hub->bcd_usb < USB_SS_BCD ? 100 : 150;
+    struct libusb_device * udev;
+    int i = 0;
+    while ((udev = usb_devs[i++]) != NULL) {
+        struct libusb_device * parent = libusb_get_parent(udev);
+        if (parent == NULL || libusb_get_port_number(udev) != port)
+            continue;
+        if (parent != hub->dev &&
+            (hub->dual < 0 || parent != hubs[hub->dual].dev))
+            continue;
+        struct libusb_device_descriptor desc;
+        struct libusb_config_descriptor *config;
+        if (libusb_get_device_descriptor(udev, &desc) == 0 &&
+            libusb_get_active_config_descriptor(udev, &config) == 0)
+        {
+            /* bMaxPower is in 2 mA units, or 8 mA units for SuperSpeed */
+            int unit = libusb_le16_to_cpu(desc.bcdUSB) >= USB_SS_BCD ? 8 : 2;
+            current = config->MaxPower * unit;
+            libusb_free_config_descriptor(config);
+            break;
+        }
+    }
+    return current;
+}
+
+
+/*
+ * Recursive helper for plan_power_waves():
+ * try to put items order[i..n-1] into k waves without exceeding budget.
+ */
+
+static int pack_waves(int i, int n, const int *order, const int *current,
+                      int budget, int k, int *load, int *wave)
+{
+    int b, j;
+    if (i == n)
+        return 1;
+    int item = order[i];
+    for (b = 0; b < k; b++) {
+        if (load[b] + current[item] > budget)
+            continue;
+        /* waves with equal load are interchangeable, try only first one */
+        for (j = 0; j < b && load[j] != load[b]; j++);
+        if (j < b)
+            continue;
+        load[b] += current[item];
+        wave[item] = b;
+        if (pack_waves(i+1, n, order, current, budget, k, load, wave))
+            return 1;
+        load[b] -= current[item];
+    }
+    return 0;
+}
+
+
+/*
+ * Split ports from portmask of hub devhs[h] which are currently off
+ * into power on waves, so that estimated current of all ports switched
+ * on at once stays within opt_budget (minus current required by hub
+ * controller). USB2/USB3 dual hub is one physical hub, so its port is
+ * planned once, and it is off if it is off on either side.
+ * Uses smallest possible number of waves - this is bin packing problem,
+ * but hubs have few ports, so exhaustive search is fast enough.
+ * wave[port] is set to wave number for every port.
+ * Returns number of waves.
+ */
+
+static int plan_power_waves(struct libusb_device_handle ** devhs, int h,
+                            int portmask, int *wave)
+{
+    int current[MAX_HUB_PORTS];
+    int order[MAX_HUB_PORTS];
+    int load[MAX_HUB_PORTS] = {0};
+    int n = 0;
+    int sum = 0;
+    int port, i, j, k;
+    struct hub_info * hub = &hubs[h];
+    int dual = hub->dual;
+    if (dual >= 0 && devhs[dual] == NULL)
+        dual = -1;
+    int contr_current = hub->contr_current;
+    if (dual >= 0 && hubs[dual].contr_current > contr_current)
+        contr_current = hubs[dual].contr_current;
+    int budget = opt_budget - contr_current;
+    if (budget <= 0)
+        budget = 1; /* one port per wave */
+    for (port = 1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+        wave[port] = 0;
+        if (!(portmask & (1 << (port-1))))
+            continue;
+        int port_status = get_port_status(devhs[h], port);
+        int on = port_status >= 0 && (port_status & port_power_mask(hub));
+        if (on && dual >= 0 && port <= hubs[dual].nports) {
+            port_status = get_port_status(devhs[dual], port);
+            on = port_status >= 0 && (port_status & port_power_mask(&hubs[dual]));
+        }
+        if (on)
+            continue;
+        current[port-1] = get_port_current(hub, port);
+        if (dual >= 0 && get_port_current(&hubs[dual], port) > current[port-1])
+            current[port-1] = get_port_current(&hubs[dual], port);
+        if (current[port-1] > budget)
+            current[port-1] = budget; /* such port gets its own wave */
+        sum += current[port-1];
+        /* insertion sort, biggest current first */
+        for (i = n; i > 0 && current[order[i-1]] < current[port-1]; i--)
+            order[i] = order[i-1];
+        order[i] = port-1;
+        n++;
+    }
+    if (n == 0)
+        return 1;
+    /* n waves always work, so this loop terminates */
+    for (k = sum > budget ? (sum + budget - 1) / budget : 1; k < n; k++) {
+        if (pack_waves(0, n, order, current, budget, k, load, wave+1))
+            return k;
+    }
+    for (j = 0; j < n; j++)
+        wave[order[j]+1] = j;
+    return n;
+}
+
+
+/*
+ * State of one port for staged_power_on().
+ */
+
+#define ENUM_PENDING    0
+#define ENUM_INFLIGHT   1
+#define ENUM_DONE       2
+
+struct enum_job {
+    struct hub_info * hub;
+    struct libusb_device_handle * devh;
+    struct hub_info * dual_hub;            /* other side of USB3 dual hub */
+    struct libusb_device_handle * dual_devh;
+    int port;
+    int state;
+    int64_t start;   /* when power on request was sent */
+    int arrived;     /* set by hotplug callback */
+    int holds;       /* counts against enumeration slots of its buses */
+};
+
+static struct enum_job enum_jobs[MAX_HUBS * MAX_HUB_PORTS];
+static int enum_job_count = 0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+static int LIBUSB_CALL enum_hotplug_callback(struct libusb_context *ctx,
+    struct libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    int j;
+    (void)ctx; (void)event; (void)user_data;
+    for (j=0; j<enum_job_count; j++) {
+        if (enum_jobs[j].state == ENUM_INFLIGHT &&
+            (libusb_get_parent(dev) == enum_jobs[j].hub->dev ||
+             (enum_jobs[j].dual_hub != NULL &&
+              libusb_get_parent(dev) == enum_jobs[j].dual_hub->dev)) &&
+            libusb_get_port_number(dev) == enum_jobs[j].port)
+        {
+            enum_jobs[j].arrived = 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+
+/*
+ * Power on selected ports of all actionable hubs, but let only opt_enum
+ * ports per USB bus enumerate at the same time. Next port is released
+ * as soon as device on previous one shows up (hotplug event or port
+ * becomes enabled), or it is clear that nothing is connected to it:
+ * after power good time, only ports with connection hold a slot.
+ * Port of USB3 dual hub is one job, powering both sides at once
+ * and taking a slot on both buses.
+ * devhs[] are hubs opened by caller.
+ * Returns 0 on success or libusb error code.
+ */
+
+static int staged_power_on(struct libusb_device_handle ** devhs)
+{
+    int inflight[256]; /* per bus number */
+    int remaining = 0;
+    int use_hotplug = 0;
+    int rc = 0;
+    int i, j, port;
+    int64_t t0 = time_us();
+
+    enum_job_count = 0;
+    for (i=0; i<hub_count; i++) {
+        int dual = hubs[i].dual;
+        if (devhs[i] == NULL || hub_cut_by(i, &port) >= 0)
+            continue;
+        /* port of dual hub pair is scheduled once, with its partner */
+        if (dual >= 0 && dual < i && devhs[dual] != NULL)
+            continue;
+        if (dual >= 0 && devhs[dual] == NULL)
+            dual = -1;
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+            if (!((1 << (port-1)) & hub_phase_ports(&hubs[i], 1)))
+                continue;
+            int pair[2] = { i, dual };
+            int powered = 1;
+            int h;
+            for (h=0; h<2; h++) {
+                if (pair[h] < 0 || port > hubs[pair[h]].nports)
+                    continue;
+                int power_mask = port_power_mask(&hubs[pair[h]]);
+                int port_status = get_port_status(devhs[pair[h]], port);
+                if (port_status < 0 || !(port_status & power_mask))
+                    powered = 0;
+            }
+            if (powered)
+                continue;
+            struct enum_job * job = &enum_jobs[enum_job_count++];
+            job->hub     = &hubs[i];
+            job->devh    = devhs[i];
+            job->dual_hub  = (dual >= 0 && port <= hubs[dual].nports) ? &hubs[dual] : NULL;
+            job->dual_devh = job->dual_hub != NULL ? devhs[dual] : NULL;
+            job->port    = port;
+            job->state   = ENUM_PENDING;
+            job->arrived = 0;
+            job->holds   = 0;
+            remaining++;
+        }
+    }
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    libusb_hotplug_callback_handle hotplug;
+    if (rc == 0 && !opt_dry_run && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        use_hotplug = libusb_hotplug_register_callback(NULL,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+            LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, enum_hotplug_callback, NULL,
+            &hotplug) == LIBUSB_SUCCESS;
+    }
+#endif
+
+    printf("Powering on %d port(s), %d port(s) per bus enumerate at once\n",
+        remaining, opt_enum);
+    while (rc == 0 && remaining > 0) {
+        int64_t now = time_us();
+        memset(inflight, 0, sizeof(inflight));
+        for (j=0; j<enum_job_count; j++) {
+            struct enum_job * job = &enum_jobs[j];
+            if (job->state != ENUM_INFLIGHT || !job->holds)
+                continue;
+            inflight[libusb_get_bus_number(job->hub->dev)]++;
+            if (job->dual_hub != NULL)
+                inflight[libusb_get_bus_number(job->dual_hub->dev)]++;
+        }
+        /* release pending ports into free bus slots */
+        for (j=0; j<enum_job_count; j++) {
+            struct enum_job * job = &enum_jobs[j];
+            int bus = libusb_get_bus_number(job->hub->dev);
+            int dual_bus = job->dual_hub != NULL ?
+                libusb_get_bus_number(job->dual_hub->dev) : bus;
+            if (job->state != ENUM_PENDING || inflight[bus] >= opt_enum ||
+                inflight[dual_bus] >= opt_enum)
+                continue;
+            if (set_port_power(job->devh, job->port, 1) < 0 ||
+                (job->dual_devh != NULL &&
+                 set_port_power(job->dual_devh, job->port, 1) < 0))
+            {
+                perror("Failed to control port power!\n");
+                job->state = ENUM_DONE;
+                remaining--;
+                continue;
+            }
+            job->start = now;
+            job->state = ENUM_INFLIGHT;
+            job->holds = 1;
+            job->hub->on_time[job->port] = time_us();
+            if (job->dual_hub != NULL)
+                job->dual_hub->on_time[job->port] = time_us();
+            inflight[bus]++;
+            if (dual_bus != bus)
+                inflight[dual_bus]++;
+        }
+        if (use_hotplug) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+            struct timeval tv = {0, ENUM_POLL_INTERVAL * 1000};
+            libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+#endif
+        } else {
+            sleep_ms(ENUM_POLL_INTERVAL);
+        }
+        now = time_us();
+        /* check ports which are enumerating now */
+        for (j=0; j<enum_job_count; j++) {
+            struct enum_job * job = &enum_jobs[j];
+            if (job->state != ENUM_INFLIGHT)
+                continue;
+            int elapsed = (int)((now - job->start) / 1000);
+            const char * result = NULL;
+            int port_status = get_port_status(job->devh, job->port);
+            int dual_status = job->dual_devh != NULL ?
+                get_port_status(job->dual_devh, job->port) : -1;
+            int connected =
+                (port_status >= 0 && (port_status & USB_PORT_STAT_CONNECTION)) ||
+                (dual_status >= 0 && (dual_status & USB_PORT_STAT_CONNECTION));
+            int power_good = job->hub->pwr_on_2_good;
+            if (job->dual_hub != NULL && job->dual_hub->pwr_on_2_good > power_good)
+                power_good = job->dual_hub->pwr_on_2_good;
+            /* until power is good, connection cannot be seen yet */
+            job->holds = job->arrived || connected || elapsed <= power_good;
+            if (job->arrived || (port_status >= 0 &&
+                (port_status & USB_PORT_STAT_ENABLE)) ||
+                (dual_status >= 0 && (dual_status & USB_PORT_STAT_ENABLE)))
+            {
+                result = "device enumerated";
+            } else if (port_status >= 0 && !connected &&
+                       elapsed > power_good + ENUM_CONNECT_TIMEOUT)
+            {
+                result = "no device";
+            } else if (elapsed > ENUM_TIMEOUT) {
+                result = "timeout";
+            }
+            if (result) {
+                printf("  Hub %s port %d: %s after %d ms\n",
+                    job->hub->location, job->port, result, elapsed);
+                job->state = ENUM_DONE;
+                remaining--;
+            }
+        }
+    }
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    if (use_hotplug)
+        libusb_hotplug_deregister_callback(NULL, hotplug);
+#endif
+    if (rc == 0) {
+        printf("All ports done in %d ms\n", (int)((time_us() - t0) / 1000));
+    }
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] == NULL || hub_cut_by(i, &port) >= 0)
+            continue;
+        print_hub_status("New", &hubs[i], devhs[i], opt_ports);
+        if (opt_reset == 1)
+            reset_hub(devhs[i]);
+    }
+    return rc;
+}
+
+
+/*
+ * State of one asynchronous power request for sync_power().
+ */
+
+struct sync_xfer {
+    struct hub_info * hub;
+    int port;
+    int status;      /* libusb_transfer_status */
+    int64_t done;    /* completion time */
+    int submitted;   /* submitted and not yet completed */
+    unsigned char setup[LIBUSB_CONTROL_SETUP_SIZE];
+};
+
+static struct sync_xfer sync_xfers[MAX_HUBS * MAX_HUB_PORTS];
+static int sync_pending = 0;
+
+static void LIBUSB_CALL sync_callback(struct libusb_transfer *transfer)
+{
+    struct sync_xfer * x = transfer->user_data;
+    x->done   = time_us();
+    x->status = transfer->status;
+    x->submitted = 0;
+    sync_pending--;
+}
+
+
+/*
+ * Turn power off (k=0) or on (k=1) for selected ports of all actionable
+ * hubs with as little skew as possible: all requests are prepared
+ * up front, submitted together and completed from one event loop.
+ * devhs[] are hubs opened by caller. New status of switched hubs
+ * is shown if show_status is set.
+ * Returns 0 on success or libusb error code.
+ */
+
+static int sync_power(struct libusb_device_handle ** devhs, int k,
+                      int show_status)
+{
+    int used[MAX_HUBS] = {0};
+    struct libusb_transfer * transfers[MAX_HUBS * MAX_HUB_PORTS];
+    int request = (k == 0) ? LIBUSB_REQUEST_CLEAR_FEATURE
+                           : LIBUSB_REQUEST_SET_FEATURE;
+    int count = 0;
+    int settle = 0; /* max settle time, repeat and wait of all hubs */
+    int repeat = 1;
+    int wait = 0;
+    int rc = 0;
+    int i, j, n, port;
+    int order[MAX_HUBS];
+
+    plan_hub_order(k, order);
+    for (n=0; n<hub_count; n++) {
+        i = order[n];
+        if (devhs[i] == NULL)
+            continue;
+        if (hub_cut_by(i, &port) >= 0)
+            continue; /* loses power with upstream hub port */
+        used[i] = 1;
+        int power_mask = port_power_mask(&hubs[i]);
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+            if (!((1 << (port-1)) & hub_phase_ports(&hubs[i], k)))
+                continue;
+            int port_status = get_port_status(devhs[i], port);
+            if (port_status < 0) {
+                fprintf(stderr, "Failed to get hub %s port %d status\n",
+                    hubs[i].location, port);
+                continue;
+            }
+            if (k == 0 && !(port_status & power_mask))
+                continue;
+            if (k == 1 && (port_status & power_mask))
+                continue;
+            struct libusb_transfer * t = libusb_alloc_transfer(0);
+            if (t == NULL) {
+                rc = LIBUSB_ERROR_NO_MEM;
+                break;
+            }
+            struct sync_xfer * x = &sync_xfers[count];
+            x->hub = &hubs[i];
+            x->port = port;
+            libusb_fill_control_setup(x->setup,
+                LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
+                request, USB_PORT_FEAT_POWER, port, 0);
+            libusb_fill_control_transfer(t, devhs[i], x->setup,
+                sync_callback, x, USB_CTRL_GET_TIMEOUT);
+            transfers[count++] = t;
+            if (hubs[i].settle > settle)
+                settle = hubs[i].settle;
+            if (hubs[i].repeat > repeat)
+                repeat = hubs[i].repeat;
+            if (hubs[i].wait > wait)
+                wait = hubs[i].wait;
+        }
+    }
+
+    if (k == 1)
+        repeat = 1;
+    while (rc == 0 && count > 0 && repeat-- > 0) {
+        int64_t submit_first = time_us();
+        int64_t submit_last = submit_first;
+        sync_pending = 0;
+        for (j=0; j<count; j++) {
+            sync_xfers[j].done = 0;
+            sync_xfers[j].submitted = 0;
+            if (opt_dry_run) {
+                set_port_power(transfers[j]->dev_handle, sync_xfers[j].port, k);
+                sync_xfers[j].status = LIBUSB_TRANSFER_COMPLETED;
+                sync_xfers[j].done = time_us();
+                submit_last = time_us();
+                continue;
+            }
+            if (libusb_submit_transfer(transfers[j]) == 0) {
+                submit_last = time_us();
+                sync_xfers[j].submitted = 1;
+                sync_pending++;
+            } else {
+                fprintf(stderr, "Failed to submit power request for hub %s port %d\n",
+                    sync_xfers[j].hub->location, sync_xfers[j].port);
+            }
+        }
+        while (sync_pending > 0) {
+            int r = libusb_handle_events(NULL);
+            if (r < 0) {
+                fprintf(stderr, "Failed to handle USB events: %s\n",
+                    libusb_error_name(r));
+                rc = r;
+                break;
+            }
+        }
+        if (sync_pending > 0) {
+            /* transfers must be done before they are retried or freed */
+            for (j=0; j<count; j++) {
+                if (sync_xfers[j].submitted)
+                    libusb_cancel_transfer(transfers[j]);
+            }
+            while (sync_pending > 0)
+                libusb_handle_events(NULL);
+        }
+        int64_t first = 0, last = 0;
+        int ok = 0;
+        for (j=0; j<count; j++) {
+            struct sync_xfer * x = &sync_xfers[j];
+            if (x->done == 0)
+                continue;
+            if (x->status != LIBUSB_TRANSFER_COMPLETED) {
+                /* retry synchronously, losing simultaneity for this port */
+                if (set_port_power(transfers[j]->dev_handle, x->port, k) < 0) {
+                    fprintf(stderr, "Failed to control power for hub %s port %d\n",
+                        x->hub->location, x->port);
+                    continue;
+                }
+                x->done = time_us();
+            }
+            if (k == 0 && x->hub->off_time[x->port] == 0)
+                x->hub->off_time[x->port] = x->done;
+            if (k == 1)
+                x->hub->on_time[x->port] = x->done;
+            if (ok == 0 || x->done < first) first = x->done;
+            if (ok == 0 || x->done > last)  last  = x->done;
+            ok++;
+        }
+        printf("Sent power %s request to %d port(s) at once: "
+               "submitted within %d us, completion skew %d us\n",
+            k == 0 ? "off" : "on", ok,
+            (int)(submit_last - submit_first), (int)(last - first));
+        if (repeat > 0)
+            sleep_ms(wait);
+    }
+    for (j=0; j<count; j++) {
+        libusb_free_transfer(transfers[j]);
+    }
+    if (k == 0 && settle > 0)
+        sleep_ms(settle);
+    for (i=0; i<hub_count && show_status; i++) {
+        if (used[i])
+            print_hub_status("New", &hubs[i], devhs[i], opt_ports);
+    }
+    return rc;
+}
+
+
+/*
+ * Switch power of hub port which currently has given status.
+ * Power off request is repeated as configured for the hub,
+ * or in adaptive mode until port is off and disconnected.
+ * Returns libusb error code of last request.
+ */
+
+static int switch_port_power(struct libusb_device_handle *devh,
+                             struct hub_info * hub, int port, int on,
+                             int port_status)
+{
+    int power_mask = port_power_mask(hub);
+    int repeat = 1;
+    int attempts = 0;
+    int rc = 0;
+    if (!on)
+        repeat = opt_adaptive > 0 ? opt_adaptive : hub->repeat;
+    if (!(port_status & ~power_mask))
+        repeat = 1;
+    while (repeat-- > 0) {
+        attempts++;
+        rc = set_port_power(devh, port, on);
+        if (rc < 0) {
+            fprintf(stderr, "Failed to control hub %s port %d power: %s\n",
+                hub->location, port, libusb_error_name(rc));
+        } else if (!on && hub->off_time[port] == 0) {
+            hub->off_time[port] = time_us();
+        } else if (on) {
+            hub->on_time[port] = time_us();
+        }
+        if (!on && opt_adaptive > 0) {
+            /* transient errors were already retried by set_port_feature() */
+            if (rc < 0)
+                break;
+            /* stop as soon as port is off and disconnected */
+            port_status = get_port_status(devh, port);
+            if (port_status >= 0 &&
+                !(port_status & (power_mask | USB_PORT_STAT_CONNECTION)))
+                break;
+        }
+        if (repeat > 0) {
+            sleep_ms(hub->wait);
+        }
+    }
+    if (!on && attempts > hub->off_attempts)
+        hub->off_attempts = attempts;
+    return rc;
+}
+
+
+/*
+ * Return power state which given port of hubs[i] gets when toggled.
+ * Port of USB2/USB3 dual hub pair is toggled as seen on its USB3 side,
+ * so that both sides end up in the same state. devhs[] are opened hubs.
+ * Returns 1 for on, 0 for off, or libusb error code.
+ */
+
+static int toggle_target(struct libusb_device_handle ** devhs, int i, int port)
+{
+    int h = i;
+    int dual = hubs[i].dual;
+    if (hubs[i].bcd_usb < USB_SS_BCD && dual >= 0 &&
+        devhs[dual] != NULL && port <= hubs[dual].nports)
+    {
+        h = dual;
+    }
+    int port_status = get_port_status(devhs[h], port);
+    if (port_status < 0)
+        return port_status;
+    return !(port_status & port_power_mask(&hubs[h]));
+}
+
+
+/*
+ * Run timed train of opt_count iterations (just one by default)
+ * of cycle, pulse or toggle action for selected ports of all
+ * actionable hubs. Iterations start every opt_period, and within
+ * iteration second switch happens opt_delay after first one (plus hub
+ * settle time for cycle). All switch times are absolute deadlines on
+ * monotonic clock, so errors do not accumulate. Ports are switched
+ * as in power on/off action: in hub topology order, with hub repeat
+ * and adaptive settings, skipping ports already in target state and
+ * hubs which lose power with upstream hub port. Toggle of USB2/USB3
+ * dual hub port follows power state of its USB3 side.
+ * Jitter (how late every switch happened) is reported per iteration.
+ * Returns 0 on success or libusb error code.
+ */
+
+static int pulse_train(int action)
+{
+    struct libusb_device_handle * devhs[MAX_HUBS] = {NULL};
+    int phases = (action == POWER_TOGGLE) ? 1 : 2;
+    int64_t period = opt_period;
+    int64_t gap = opt_delay;
+    int64_t jitter_min = 0, jitter_max = 0, jitter_sum = 0;
+    int target[MAX_HUBS][MAX_HUB_PORTS+1];
+    int order[2][MAX_HUBS]; /* for power off and power on */
+    int rc = 0;
+    int i, j, n, ph, port;
+
+    /* cycle keeps ports off for delay plus settle time of slowest hub */
+    for (i=0; i<hub_count; i++) {
+        if (hubs[i].actionable && phases == 2 && opt_delay + hubs[i].settle * 1000 > gap)
+            gap = opt_delay + hubs[i].settle * 1000;
+    }
+    if (period == 0)
+        period = (action == POWER_TOGGLE) ? opt_delay : opt_delay + gap;
+    if (phases == 2 && period < gap) {
+        fprintf(stderr, "Period must not be shorter than delay!\n");
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    plan_hub_order(0, order[0]);
+    plan_hub_order(1, order[1]);
+    open_hubs(devhs);
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] == NULL)
+            continue;
+        print_hub_status("Current", &hubs[i], devhs[i], opt_ports);
+        int cut_port;
+        int cut = hub_cut_by(i, &cut_port);
+        if (cut >= 0) {
+            printf("Skipping hub %s: it is powered off by hub %s port %d\n",
+                hubs[i].location, hubs[cut].location, cut_port);
+            libusb_close(devhs[i]);
+            devhs[i] = NULL;
+        }
+    }
+
+    int64_t start = time_us();
+    for (n = 0; n < opt_count; n++) {
+        int64_t jitter = 0;
+        int64_t switched[2] = {0, 0};
+        for (ph = 0; ph < phases; ph++) {
+            int64_t deadline = start + n * period + ph * (action == POWER_CYCLE ? gap : opt_delay);
+            sleep_until_us(deadline);
+            int64_t late = time_us() - deadline;
+            if (late > jitter)
+                jitter = late;
+            switched[ph] = time_us();
+            /* decide all targets first, as switching changes status */
+            for (i=0; i<hub_count; i++) {
+                if (devhs[i] == NULL)
+                    continue;
+                for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+                    if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+                        continue;
+                    if (action != POWER_TOGGLE) {
+                        /* cycle is off then on, pulse is on then off */
+                        target[i][port] = (action == POWER_PULSE) == (ph == 0);
+                        continue;
+                    }
+                    int on = toggle_target(devhs, i, port);
+                    target[i][port] = on < 0 ? -1 : on;
+                }
+            }
+            /* k=0 for power OFF, k=1 for power ON; toggle may do both */
+            int k = action != POWER_TOGGLE && (action == POWER_PULSE) == (ph == 0);
+            for (j=0; j<hub_count; j++) {
+                i = order[k][j];
+                if (devhs[i] == NULL)
+                    continue;
+                for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+                    if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+                        continue;
+                    if (target[i][port] < 0) {
+                        fprintf(stderr, "Failed to get hub %s port %d status\n",
+                            hubs[i].location, port);
+                        continue;
+                    }
+                    int port_status = get_port_status(devhs[i], port);
+                    if (port_status >= 0 &&
+                        !(port_status & port_power_mask(&hubs[i])) == !target[i][port])
+                        continue;
+                    switch_port_power(devhs[i], &hubs[i], port, target[i][port],
+                        port_status < 0 ? 0 : port_status);
+                }
+            }
+        }
+        if (n == 0 || jitter < jitter_min) jitter_min = jitter;
+        if (n == 0 || jitter > jitter_max) jitter_max = jitter;
+        jitter_sum += jitter;
+        if (phases == 2) {
+            printf("Iteration %d: jitter %d us, %s for %.3f ms\n",
+                n + 1, (int)jitter, action == POWER_PULSE ? "on" : "off",
+                (switched[1] - switched[0]) / 1000.0);
+        } else {
+            printf("Iteration %d: jitter %d us\n", n + 1, (int)jitter);
+        }
+    }
+    printf("Jitter over %d iteration(s): min %d us, avg %d us, max %d us\n",
+        opt_count, (int)jitter_min, (int)(jitter_sum / opt_count),
+        (int)jitter_max);
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] == NULL)
+            continue;
+        if (opt_adaptive > 0 && action != POWER_TOGGLE) {
+            printf("Hub %s [%s] needed %d power off attempt(s)\n",
+                hubs[i].location, hubs[i].vendor, hubs[i].off_attempts);
+        }
+        print_hub_status("New", &hubs[i], devhs[i], opt_ports);
+        if (opt_reset == 1)
+            reset_hub(devhs[i]);
+    }
+    close_hubs(devhs, 0);
+    return rc;
+}
+
+
+/*
+ * Save power state of all ports of actionable hubs to snapshot file.
+ * Every hub is one line: location, vid:pid, number of ports
+ * and hex bitmask of powered ports.
+ * Returns 0 on success or -1 on failure.
+ */
+
+static int save_snapshot(const char* filename)
+{
+    int i, port;
+    int count = 0;
+    int rc = 0;
+    FILE* f = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fprintf(f, "# uhubctl snapshot: location vid:pid ports power_mask\n");
+    for (i=0; i<hub_count && rc == 0; i++) {
+        struct libusb_device_handle * devh = NULL;
+        if (!hubs[i].actionable)
+            continue;
+        if (libusb_open(hubs[i].dev, &devh) != 0) {
+            fprintf(stderr, "Cannot open hub %s\n", hubs[i].location);
+            continue;
+        }
+        int power_mask = port_power_mask(&hubs[i]);
+        int power = 0;
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+            int port_status = get_port_status(devh, port);
+            if (port_status < 0) {
+                fprintf(stderr, "Cannot get hub %s port %d status: %s\n",
+                    hubs[i].location, port, libusb_error_name(port_status));
+                rc = -1;
+                break;
+            }
+            if (port_status & power_mask)
+                power |= 1 << (port-1);
+        }
+        libusb_close(devh);
+        if (rc < 0)
+            break;
+        fprintf(f, "%s %s %d %04x\n",
+            hubs[i].location, hubs[i].vendor, hubs[i].nports, power);
+        count++;
+    }
+    if (f != stdout) {
+        fclose(f);
+        if (rc < 0) {
+            /* do not leave incomplete snapshot behind */
+            remove(filename);
+            return rc;
+        }
+        printf("Saved power state of %d hub(s) to %s\n", count, filename);
+    }
+    return rc;
+}
+
+
+/*
+ * Restore power state of hub ports from snapshot file.
+ * Only hubs found in snapshot are touched, only ports whose state
+ * differs are switched, and requests to all hubs are sent at once.
+ * Returns 0 on success or -1 on failure.
+ */
+
+static int restore_snapshot(const char* filename)
+{
+    char line[256];
+    int i;
+    FILE* f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    for (i=0; i<hub_count; i++) {
+        hubs[i].actionable = 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char location[32];
+        char vendor[16];
+        int nports;
+        unsigned int power;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%31s %15s %d %x", location, vendor, &nports, &power) != 4) {
+            fprintf(stderr, "Invalid snapshot line: %s", line);
+            continue;
+        }
+        for (i=0; i<hub_count; i++) {
+            if (!strcasecmp(hubs[i].location, location) &&
+                !strcasecmp(hubs[i].vendor, vendor) &&
+                hubs[i].nports == nports)
+                break;
+        }
+        if (i == hub_count) {
+            fprintf(stderr, "Hub %s [%s] from snapshot not found\n", location, vendor);
+            continue;
+        }
+        hubs[i].actionable = 1;
+        hubs[i].restore_power = power & ALL_HUB_PORTS & ((1 << nports) - 1);
+    }
+    if (f != stdin)
+        fclose(f);
+    /* ports are displayed for all hubs */
+    opt_ports = ALL_HUB_PORTS;
+    struct libusb_device_handle * devhs[MAX_HUBS];
+    open_hubs(devhs);
+    int rc = sync_power(devhs, 0, 0);
+    if (rc >= 0)
+        rc = sync_power(devhs, 1, 1);
+    close_hubs(devhs, 0);
+    return rc < 0 ? -1 : 0;
+}
+
+
+/*
+ * Check if port of given hub with given status is suspended:
+ * USB2 port has suspend bit set, USB3 port is in U3 link state.
+ */
+
+static int port_suspended(const struct hub_info * hub, int port_status)
+{
+    if (hub->bcd_usb >= USB_SS_BCD)
+        return (port_status & USB_PORT_STAT_LINK_STATE) == USB_SS_PORT_LS_U3;
+    return (port_status & USB_PORT_STAT_SUSPEND) != 0;
+}
+
+
+/*
+ * Start suspend (suspend=1) or resume (suspend=0) of given hub port.
+ * USB2 ports use PORT_SUSPEND feature, USB3 ports are put into
+ * U3 link state or brought back into U0.
+ * Completion is checked with check_port_suspend().
+ * Returns 0 on success or libusb error code.
+ */
+
+static int start_port_suspend(struct libusb_device_handle *devh,
+                              struct hub_info * hub, int port, int suspend)
+{
+    if (hub->bcd_usb >= USB_SS_BCD) {
+        int link_state = suspend ? USB_SS_PORT_LS_U3 : USB_SS_PORT_LS_U0;
+        /* link state goes into upper byte of wIndex */
+        return set_port_feature(devh, port | ((link_state >> 5) << 8),
+            USB_PORT_FEAT_LINK_STATE, 1);
+    }
+    return set_port_feature(devh, port, USB_PORT_FEAT_SUSPEND, suspend);
+}
+
+
+/*
+ * Check if suspend or resume of given hub port started at time start
+ * is complete, i.e. port reached requested state.
+ * Returns 1 if it is complete, 0 if not yet, or libusb error code
+ * (LIBUSB_ERROR_TIMEOUT if it takes longer than PORT_RESUME_TIMEOUT).
+ */
+
+static int check_port_suspend(struct libusb_device_handle *devh,
+                              struct hub_info * hub, int port, int suspend,
+                              int64_t start)
+{
+    int usb3 = hub->bcd_usb >= USB_SS_BCD;
+    int change = 0;
+    int port_status = get_port_status_change(devh, port, &change);
+    if (port_status < 0)
+        return port_status;
+    int suspended = port_suspended(hub, port_status);
+    int resumed = usb3 ? (port_status & USB_PORT_STAT_LINK_STATE) == USB_SS_PORT_LS_U0
+                       : !suspended;
+    if (!(suspend ? suspended : resumed)) {
+        if (time_us() - start > PORT_RESUME_TIMEOUT * 1000)
+            return LIBUSB_ERROR_TIMEOUT;
+        return 0;
+    }
+    if (!usb3 && (change & USB_PORT_STAT_C_SUSPEND))
+        set_port_feature(devh, port, USB_PORT_FEAT_C_SUSPEND, 0);
+    return 1;
+}
+
+
+/*
+ * Suspend (suspend=1) or resume (suspend=0) given hub port
+ * and wait until port reaches requested state.
+ * Returns time in microseconds it took, or libusb error code.
+ */
+
+static int suspend_port(struct libusb_device_handle *devh,
+                        struct hub_info * hub, int port, int suspend)
+{
+    int64_t start = time_us();
+    int rc = start_port_suspend(devh, hub, port, suspend);
+    if (rc < 0 || opt_dry_run) /* completion is not simulated */
+        return rc;
+    while ((rc = check_port_suspend(devh, hub, port, suspend, start)) == 0)
+        sleep_ms(1);
+    if (rc < 0)
+        return rc;
+    return (int)(time_us() - start);
+}
+
+
+/*
+ * Set U1/U2 timeouts (if requested) for selected ports of actionable
+ * USB3 hubs, and sample link state of these ports every
+ * LPM_SAMPLE_INTERVAL for opt_residency to report how much time
+ * they spend in U0, U1, U2 and U3.
+ * U1 timeout is in microseconds, U2 timeout in 256 us units,
+ * 0 disables entry into U1/U2, 255 means that hub never initiates it
+ * (U1 timeouts 128 to 254 are reserved and rejected by option parsing).
+ * Returns 0 on success or -1 on failure.
+ */
+
+static int lpm_control()
+{
+    struct libusb_device_handle * devhs[MAX_HUBS] = {NULL};
+    /* samples per hub port for U0, U1, U2, U3 and other link states */
+    static int samples[MAX_HUBS][MAX_HUB_PORTS][5];
+    int failed = 0;
+    int total = 0;
+    int i, port, j;
+
+    for (i=0; i<hub_count; i++) {
+        if (!hubs[i].actionable || hubs[i].bcd_usb < USB_SS_BCD)
+            continue;
+        if (libusb_open(hubs[i].dev, &devhs[i]) != 0) {
+            devhs[i] = NULL;
+            continue;
+        }
+        for (port=1; port <= hubs[i].nports; port++) {
+            if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+                continue;
+            if (opt_u1_timeout >= 0) {
+                /* timeout goes into upper byte of wIndex */
+                if (set_port_feature(devhs[i], port | (opt_u1_timeout << 8),
+                        USB_PORT_FEAT_U1_TIMEOUT, 1) < 0 ||
+                    set_port_feature(devhs[i], port | (opt_u2_timeout << 8),
+                        USB_PORT_FEAT_U2_TIMEOUT, 1) < 0)
+                {
+                    fprintf(stderr, "Failed to set LPM timeouts for hub %s port %d\n",
+                        hubs[i].location, port);
+                    failed = 1;
+                } else {
+                    printf("Hub %s port %d: U1 timeout %d, U2 timeout %d\n",
+                        hubs[i].location, port, opt_u1_timeout, opt_u2_timeout);
+                }
+            }
+        }
+    }
+
+    if (opt_residency > 0) {
+        int64_t start = time_us();
+        int64_t end = start + opt_residency;
+        while (time_us() < end) {
+            for (i=0; i<hub_count; i++) {
+                if (devhs[i] == NULL)
+                    continue;
+                for (port=1; port <= hubs[i].nports; port++) {
+                    if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+                        continue;
+                    int port_status = get_port_status(devhs[i], port);
+                    if (port_status < 0)
+                        continue;
+                    int link_state = port_status & USB_PORT_STAT_LINK_STATE;
+                    j = 4;
+                    if (link_state == USB_SS_PORT_LS_U0) j = 0;
+                    if (link_state == USB_SS_PORT_LS_U1) j = 1;
+                    if (link_state == USB_SS_PORT_LS_U2) j = 2;
+                    if (link_state == USB_SS_PORT_LS_U3) j = 3;
+                    samples[i][port-1][j]++;
+                }
+            }
+            total++;
+            /* evenly spaced samples, without flooding hub with requests */
+            sleep_until_us(start + total * LPM_SAMPLE_INTERVAL * 1000);
+        }
+        printf("Link state residency over %.3f ms (%d samples):\n",
+            opt_residency / 1000.0, total);
+        for (i=0; i<hub_count; i++) {
+            if (devhs[i] == NULL)
+                continue;
+            for (port=1; port <= hubs[i].nports; port++) {
+                int n = 0;
+                if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+                    continue;
+                for (j=0; j<5; j++) n += samples[i][port-1][j];
+                if (n == 0)
+                    continue;
+                printf("  Hub %s port %d: U0 %.1f%%, U1 %.1f%%, U2 %.1f%%, U3 %.1f%%, other %.1f%%\n",
+                    hubs[i].location, port,
+                    100.0 * samples[i][port-1][0] / n,
+                    100.0 * samples[i][port-1][1] / n,
+                    100.0 * samples[i][port-1][2] / n,
+                    100.0 * samples[i][port-1][3] / n,
+                    100.0 * samples[i][port-1][4] / n);
+            }
+        }
+    }
+
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] != NULL)
+            libusb_close(devhs[i]);
+    }
+    return failed ? -1 : 0;
+}
+
+
+/*
+ * Measure timing of given hub together with its dual hub:
+ * how many power off requests are needed and how long status takes
+ * to reflect them, how long attached devices take to disappear,
+ * and how long status takes to reflect power on.
+ * Every selected powered port is switched off and back on, one by one.
+ * Returns 1 if results were stored into hub repeat/wait/settle,
+ * 0 if there was nothing to measure, or -1 on error.
+ */
+
+static int calibrate_hub(int i)
+{
+    int pair[2] = { i, hubs[i].dual };
+    int n = (pair[1] >= 0 && hubs[pair[1]].actionable) ? 2 : 1;
+    struct libusb_device_handle * devh[2] = { NULL, NULL };
+    int power_mask[2];
+    int max_attempts = 0;
+    int64_t max_off = 0, max_gone = 0;
+    int h, port;
+
+    for (h=0; h<n; h++) {
+        struct hub_info * hub = &hubs[pair[h]];
+        power_mask[h] = port_power_mask(hub);
+        if (libusb_open(hub->dev, &devh[h]) != 0) {
+            fprintf(stderr, "Cannot open hub %s\n", hub->location);
+            while (h-- > 0)
+                libusb_close(devh[h]);
+            return -1;
+        }
+    }
+    for (port=1; port <= hubs[i].nports; port++) {
+        if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+            continue;
+        int powered = 1;
+        int connected = 0;
+        for (h=0; h<n; h++) {
+            int port_status = get_port_status(devh[h], port);
+            if (port_status < 0 || !(port_status & power_mask[h]))
+                powered = 0;
+            if (port_status > 0 && (port_status & USB_PORT_STAT_CONNECTION))
+                connected = 1;
+        }
+        if (!powered)
+            continue;
+
+        /* power off, repeating request until status reflects it */
+        int attempts = 0;
+        int64_t start = time_us();
+        int64_t last = 0, t_off = 0, t_gone = 0, t_on = 0;
+        while (t_off == 0 || (connected && t_gone == 0)) {
+            int64_t now = time_us();
+            if (now - start > CALIBRATE_TIMEOUT * 1000)
+                break;
+            if (t_off == 0 && (last == 0 || now - last >= CALIBRATE_RETRY * 1000)) {
+                for (h=0; h<n; h++)
+                    set_port_power(devh[h], port, 0);
+                attempts++;
+                last = time_us();
+            }
+            sleep_ms(1);
+            int all_off = 1;
+            int any_connect = 0;
+            for (h=0; h<n; h++) {
+                int port_status = get_port_status(devh[h], port);
+                if (port_status < 0 || (port_status & power_mask[h]))
+                    all_off = 0;
+                if (port_status > 0 && (port_status & USB_PORT_STAT_CONNECTION))
+                    any_connect = 1;
+            }
+            now = time_us();
+            if (t_off == 0 && all_off)
+                t_off = now - last; /* since request which worked */
+            if (connected && t_gone == 0 && !any_connect)
+                t_gone = now - start;
+        }
+
+        /* power back on */
+        for (h=0; h<n; h++)
+            set_port_power(devh[h], port, 1);
+        start = time_us();
+        while (t_on == 0 && time_us() - start <= CALIBRATE_TIMEOUT * 1000) {
+            sleep_ms(1);
+            int all_on = 1;
+            for (h=0; h<n; h++) {
+                int port_status = get_port_status(devh[h], port);
+                if (port_status < 0 || !(port_status & power_mask[h]))
+                    all_on = 0;
+            }
+            if (all_on)
+                t_on = time_us() - start;
+        }
+
+        if (t_off == 0) {
+            fprintf(stderr, "Hub %s port %d: did not turn off after %d request(s)\n",
+                hubs[i].location, port, attempts);
+            continue;
+        }
+        printf("Hub %s port %d: off after %d request(s) in %.3f ms",
+            hubs[i].location, port, attempts, t_off / 1000.0);
+        if (t_gone > 0)
+            printf(", device gone in %.3f ms", t_gone / 1000.0);
+        else if (connected)
+            printf(", device did not disappear");
+        if (t_on > 0)
+            printf(", on in %.3f ms", t_on / 1000.0);
+        printf("\n");
+        if (attempts > max_attempts)
+            max_attempts = attempts;
+        if (t_off > max_off)
+            max_off = t_off;
+        if (t_gone > max_gone)
+            max_gone = t_gone;
+    }
+    for (h=0; h<n; h++)
+        libusb_close(devh[h]);
+    if (max_attempts == 0) {
+        printf("Hub %s: no powered ports to calibrate\n", hubs[i].location);
+        return 0;
+    }
+    for (h=0; h<n; h++) {
+        struct hub_info * hub = &hubs[pair[h]];
+        hub->repeat = max_attempts;
+        /* give hub as much time between requests as status took to change */
+        hub->wait   = (int)((max_off + 999) / 1000);
+        /* wait for devices to go away if there were any */
+        hub->settle = (int)(((max_gone > max_off ? max_gone : max_off) + 999) / 1000);
+        hub->calibrated = 1;
+        printf("Hub %s [%s]: repeat=%d wait=%d settle=%d\n",
+            hub->location, hub->vendor, hub->repeat, hub->wait, hub->settle);
+    }
+    return 1;
+}
+
+
+/*
+ * Read all lines of quirks file into quirk_lines[], so that file
+ * can be written back with some of them changed. Missing file
+ * has no lines. Returns number of lines, or -1 if file has more
+ * lines than can be kept.
+ */
+
+static char quirk_lines[MAX_QUIRKS * 2][256];
+
+static int read_quirk_lines(const char* filename)
+{
+    char line[256];
+    int count = 0;
+    FILE* f = fopen(filename, "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (count == MAX_QUIRKS * 2) {
+            fclose(f);
+            return -1;
+        }
+        strcpy(quirk_lines[count++], line);
+    }
+    fclose(f);
+    return count;
+}
+
+
+/*
+ * Save calibration results for all calibrated hubs into quirks file,
+ * replacing previous results for the same hubs and keeping other lines.
+ * Returns 0 on success, or -1 on failure (file is not changed if it
+ * has more lines than can be kept).
+ */
+
+static int save_calibration(const char* filename)
+{
+    int count = read_quirk_lines(filename);
+    int i, j;
+    if (count < 0) {
+        fprintf(stderr, "Quirks file %s is too long, calibration not saved!\n",
+            filename);
+        return -1;
+    }
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    for (j=0; j<count; j++) {
+        char id[64] = "";
+        sscanf(quirk_lines[j], "%63s", id);
+        for (i=0; i<hub_count; i++) {
+            char hub_id[64];
+            snprintf(hub_id, sizeof(hub_id), "%s@%s",
+                hubs[i].vendor, hubs[i].location);
+            if (hubs[i].calibrated && !strcasecmp(id, hub_id))
+                break;
+        }
+        if (i == hub_count)
+            fputs(quirk_lines[j], f);
+    }
+    for (i=0; i<hub_count; i++) {
+        if (!hubs[i].calibrated)
+            continue;
+        fprintf(f, "%s@%s repeat=%d wait=%d settle=%d\n",
+            hubs[i].vendor, hubs[i].location,
+            hubs[i].repeat, hubs[i].wait, hubs[i].settle);
+    }
+    fclose(f);
+    printf("Calibration saved to %s\n", filename);
+    return 0;
+}
+
+
+/*
+ * Save number of power off attempts which hubs needed in adaptive mode
+ * into quirks file as repeat setting of their model (VID:PID), so that
+ * later runs without -A send that many requests. If hubs of the same
+ * model needed different counts, the biggest one is saved. Existing
+ * line for the model gets its repeat replaced, other settings on it
+ * are kept. Returns 0 on success, or -1 on failure (file is not changed
+ * if it has more lines than can be kept).
+ */
+
+static int save_attempts(const char* filename)
+{
+    int attempts[MAX_HUBS]; /* per model, at its first hub */
+    int saved[MAX_HUBS];
+    int models = 0;
+    int i, j;
+    for (i=0; i<hub_count; i++) {
+        attempts[i] = 0;
+        saved[i] = 0;
+        if (hubs[i].off_attempts == 0)
+            continue;
+        for (j=0; j<i && strcasecmp(hubs[j].vendor, hubs[i].vendor); j++);
+        if (j == i)
+            models++;
+        if (hubs[i].off_attempts > attempts[j])
+            attempts[j] = hubs[i].off_attempts;
+    }
+    if (models == 0)
+        return 0;
+    int count = read_quirk_lines(filename);
+    if (count < 0) {
+        fprintf(stderr, "Quirks file %s is too long, power off attempts not saved!\n",
+            filename);
+        return -1;
+    }
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    for (j=0; j<count; j++) {
+        char* line = quirk_lines[j];
+        char id[64] = "";
+        sscanf(line, "%63s", id);
+        for (i=0; i<hub_count; i++) {
+            if (attempts[i] > 0 && !strcasecmp(id, hubs[i].vendor))
+                break;
+        }
+        if (i == hub_count) {
+            fputs(line, f);
+            continue;
+        }
+        /* rewrite line with new repeat, keeping other settings and comment */
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = 0;
+        char* tok = strtok(line, " \t\r\n");
+        fputs(tok, f);
+        while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+            if (strncasecmp(tok, "repeat=", 7))
+                fprintf(f, " %s", tok);
+        }
+        fprintf(f, " repeat=%d", attempts[i]);
+        if (comment != NULL)
+            fprintf(f, " #%s", comment + 1);
+        else
+            fprintf(f, "\n");
+        saved[i] = 1;
+    }
+    for (i=0; i<hub_count; i++) {
+        if (attempts[i] > 0 && !saved[i])
+            fprintf(f, "%s repeat=%d\n", hubs[i].vendor, attempts[i]);
+    }
+    fclose(f);
+    printf("Power off attempts of %d hub model(s) saved to %s\n", models, filename);
+    return 0;
+}
+
+
+/*
+ * Calibrate all selected hubs and save results.
+ */
+
+static int calibrate()
+{
+    int calibrated = 0;
+    int i;
+    if (opt_dry_run) {
+        fprintf(stderr, "Calibration cannot be done in dry run!\n");
+        return -1;
+    }
+    for (i=0; i<hub_count; i++) {
+        if (!hubs[i].actionable)
+            continue;
+        /* dual hubs are calibrated together */
+        int dual = hubs[i].dual;
+        if (dual >= 0 && dual < i && hubs[dual].actionable)
+            continue;
+        int rc = calibrate_hub(i);
+        if (rc < 0)
+            return rc;
+        calibrated += rc;
+    }
+    if (calibrated == 0)
+        return 0;
+    if (strlen(opt_quirks) == 0) {
+        fprintf(stderr, "Use -Q to specify file to save calibration!\n");
+        return -1;
+    }
+    return save_calibration(opt_quirks);
+}
+
+
+/*
+ * Perform port action which does not change port power
+ * (per-port reset, suspend or resume) on selected ports
+ * of all actionable hubs.
+ * Ports with nothing connected are skipped.
+ * Returns 0 on success or -1 if action failed for some port.
+ */
+
+static int run_port_action(int action)
+{
+    int failed = 0;
+    int i, port;
+    for (i=0; i<hub_count; i++) {
+        struct libusb_device_handle * devh = NULL;
+        if (!hubs[i].actionable)
+            continue;
+        if (libusb_open(hubs[i].dev, &devh) != 0) {
+            fprintf(stderr, "Cannot open hub %s\n", hubs[i].location);
+            continue;
+        }
+        print_hub_status("Current", &hubs[i], devh, opt_ports);
+        for (port=1; port <= hubs[i].nports; port++) {
+            if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+                continue;
+            int port_status = get_port_status(devh, port);
+            if (port_status < 0 || !(port_status & USB_PORT_STAT_CONNECTION))
+                continue;
+            int suspended = port_suspended(&hubs[i], port_status);
+            const char* done = NULL;
+            int rc = 0;
+            if (action == PORT_RESET) {
+                rc = reset_port(devh, &hubs[i], port);
+                done = "reset";
+            } else if (action == PORT_SUSPEND && !suspended) {
+                rc = suspend_port(devh, &hubs[i], port, 1);
+                done = "suspended";
+            } else if (action == PORT_RESUME && suspended) {
+                rc = suspend_port(devh, &hubs[i], port, 0);
+                done = "resumed";
+            }
+            if (done == NULL) {
+                printf("Hub %s port %d: already %s\n", hubs[i].location, port,
+                    suspended ? "suspended" : "active");
+            } else if (rc < 0) {
+                fprintf(stderr, "Failed to %s hub %s port %d: %s\n",
+                    action == PORT_RESET   ? "reset" :
+                    action == PORT_SUSPEND ? "suspend" : "resume",
+                    hubs[i].location, port, libusb_error_name(rc));
+                failed = 1;
+            } else {
+                printf("Hub %s port %d: %s in %.3f ms\n",
+                    hubs[i].location, port, done, rc / 1000.0);
+            }
+        }
+        print_hub_status("New", &hubs[i], devh, opt_ports);
+        libusb_close(devh);
+    }
+    return failed ? -1 : 0;
+}
+
+
+/*
+ * Check if device matches device spec. Serial number is compared
+ * only if it was given, because device has to be opened to read it.
+ */
+
+static int device_match(struct libusb_device * dev,
+                        const struct device_spec * device)
+{
+    struct libusb_device_descriptor desc;
+    struct libusb_device_handle *devh = NULL;
+    char serial[64] = "";
+    if (libusb_get_device_descriptor(dev, &desc) != 0)
+        return 0;
+    if (device->vid >= 0 && libusb_le16_to_cpu(desc.idVendor) != device->vid)
+        return 0;
+    if (device->pid >= 0 && libusb_le16_to_cpu(desc.idProduct) != device->pid)
+        return 0;
+    if (strlen(device->serial) == 0)
+        return 1;
+    if (desc.iSerialNumber == 0 || libusb_open(dev, &devh) != 0)
+        return 0;
+    libusb_get_string_descriptor_ascii(devh,
+        desc.iSerialNumber, (unsigned char*)serial, sizeof(serial));
+    libusb_close(devh);
+    return strcmp(rtrim(serial), device->serial) == 0;
+}
+
+
+/*
+ * Count devices matching device spec. Device list is fetched again,
+ * so that devices which arrived or left since start are seen.
+ * Returns number of matching devices, or libusb error code.
+ */
+
+static int count_devices(const struct device_spec * device)
+{
+    struct libusb_device **devs;
+    int count = 0;
+    int i = 0;
+    int rc = libusb_get_device_list(NULL, &devs);
+    if (rc < 0)
+        return rc;
+    while (devs[i] != NULL) {
+        if (device_match(devs[i++], device))
+            count++;
+    }
+    libusb_free_device_list(devs, 1);
+    return count;
+}
+
+
+/*
+ * Hotplug events used to wake up wait_event().
+ */
+
+static int hotplug_events = 0;
+static int hotplug_registered = 0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+static libusb_hotplug_callback_handle wait_hotplug;
+
+static int LIBUSB_CALL wait_hotplug_callback(struct libusb_context *ctx,
+    struct libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    (void)ctx; (void)dev; (void)event; (void)user_data;
+    hotplug_events++;
+    return 0;
+}
+#endif
+
+
+/*
+ * Subscribe to arrival and removal of devices matching VID:PID
+ * of device spec, or of any device if device is NULL.
+ * If hotplug is not supported, wait_event() falls back
+ * to sleeping WAIT_POLL_INTERVAL.
+ */
+
+static void wait_events_start(const struct device_spec * device)
+{
+    hotplug_events = 0;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    if (!opt_dry_run && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        hotplug_registered = libusb_hotplug_register_callback(NULL,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_NO_FLAGS,
+            device != NULL && device->vid >= 0 ? device->vid : LIBUSB_HOTPLUG_MATCH_ANY,
+            device != NULL && device->pid >= 0 ? device->pid : LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, wait_hotplug_callback, NULL,
+            &wait_hotplug) == LIBUSB_SUCCESS;
+    }
+#endif
+}
+
+
+static void wait_events_stop()
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    if (hotplug_registered)
+        libusb_hotplug_deregister_callback(NULL, wait_hotplug);
+#endif
+    hotplug_registered = 0;
+}
+
+
+/*
+ * Block until hotplug event arrives, WAIT_POLL_INTERVAL passes
+ * or deadline expires, whichever comes first.
+ * Returns 1 if there were hotplug events since last call,
+ * or if hotplug is not supported and devices have to be checked.
+ */
+
+static int wait_event(int64_t deadline)
+{
+    int64_t now = time_us();
+    int64_t until = now + WAIT_POLL_INTERVAL * 1000;
+    if (until > deadline)
+        until = deadline;
+    if (!hotplug_registered) {
+        sleep_until_us(until);
+        return 1;
+    }
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    while (hotplug_events == 0 && now < until) {
+        struct timeval tv = {0, (long)(until - now)};
+        libusb_handle_events_timeout_completed(NULL, &tv, &hotplug_events);
+        now = time_us();
+    }
+#endif
+    int events = hotplug_events;
+    hotplug_events = 0;
+    return events > 0;
+}
+
+
+/*
+ * Find smart hub port which powers given device: port of hub
+ * it is attached to, or of nearest upstream smart hub if device
+ * is behind hub without power switching. Only actionable hubs
+ * are considered. Returns index of hub and sets *port, or returns -1.
+ */
+
+static int find_device_port(struct libusb_device * dev, int *port)
+{
+    struct libusb_device * parent;
+    int i;
+    while ((parent = libusb_get_parent(dev)) != NULL) {
+        for (i=0; i<hub_count; i++) {
+            if (hubs[i].dev == parent && hubs[i].actionable) {
+                *port = libusb_get_port_number(dev);
+                return i;
+            }
+        }
+        dev = parent;
+    }
+    return -1;
+}
+
+
+/*
+ * Power cycle smart hub port which -V device is on (together with
+ * port of USB2/USB3 dual hub), and wait until device is back
+ * or opt_timeout expires. Device has to be seen gone first,
+ * so that it is not mistaken for itself before power off.
+ * Off time, time for device to disappear and time for it
+ * to reappear after power on are reported.
+ * Returns 0 on success or -1 on failure.
+ */
+
+static int reboot_device()
+{
+    struct libusb_device_handle * devh[2] = { NULL, NULL };
+    struct libusb_device * dev = NULL;
+    char description[256] = "";
+    int pair[2];
+    int matches = 0;
+    int port = 0;
+    int delay_ms = (int)(opt_delay / 1000);
+    int rc = 0;
+    int i, h, n;
+
+    if (!opt_device_set) {
+        fprintf(stderr, "Use -V to specify device to reboot!\n");
+        return -1;
+    }
+    for (i=0; usb_devs[i] != NULL; i++) {
+        if (device_match(usb_devs[i], &opt_device) && matches++ == 0)
+            dev = usb_devs[i];
+    }
+    if (matches == 0) {
+        fprintf(stderr, "Device not found!\n");
+        return -1;
+    }
+    if (matches > 1) {
+        fprintf(stderr, "Device is ambiguous (%d matches), add serial number to -V!\n",
+            matches);
+        return -1;
+    }
+    get_device_description(dev, description, sizeof(description));
+    pair[0] = find_device_port(dev, &port);
+    if (pair[0] < 0) {
+        fprintf(stderr, "Device [%s] is not behind any selected smart hub!\n",
+            description);
+        return -1;
+    }
+    pair[1] = hubs[pair[0]].dual;
+    n = (pair[1] >= 0 && port <= hubs[pair[1]].nports) ? 2 : 1;
+    printf("Device [%s] is on hub %s port %d\n",
+        description, hubs[pair[0]].location, port);
+    for (h=0; h<n; h++) {
+        struct hub_info * hub = &hubs[pair[h]];
+        if (libusb_open(hub->dev, &devh[h]) != 0) {
+            fprintf(stderr, "Cannot open hub %s\n", hub->location);
+            while (h-- > 0)
+                libusb_close(devh[h]);
+            return -1;
+        }
+        print_hub_status("Current", hub, devh[h], 1 << (port-1));
+        if (hub->settle > delay_ms)
+            delay_ms = hub->settle;
+    }
+
+    wait_events_start(&opt_device);
+    int64_t off = 0, gone = 0, on = 0, back = 0;
+    for (h=0; h<n && rc >= 0; h++) {
+        struct hub_info * hub = &hubs[pair[h]];
+        int repeat = hub->repeat;
+        while (repeat-- > 0 && rc >= 0) {
+            rc = set_port_power(devh[h], port, 0);
+            if (off == 0)
+                off = time_us();
+            if (repeat > 0)
+                sleep_ms(hub->wait);
+        }
+    }
+    int64_t on_at = off + (int64_t)delay_ms * 1000;
+    int64_t deadline = on_at + opt_timeout;
+    while (rc >= 0 && back == 0 && time_us() < deadline) {
+        if (opt_dry_run) {
+            sleep_until_us(on_at);
+        } else if (wait_event(on == 0 ? on_at : deadline)) {
+            int count = count_devices(&opt_device);
+            if (count == 0 && gone == 0)
+                gone = time_us();
+            if (count > 0 && gone != 0 && on != 0)
+                back = time_us();
+        }
+        if (on == 0 && time_us() >= on_at) {
+            for (h=0; h<n && rc >= 0; h++)
+                rc = set_port_power(devh[h], port, 1);
+            on = time_us();
+            if (opt_dry_run)
+                break; /* device arrival is not simulated */
+        }
+    }
+    wait_events_stop();
+
+    if (rc < 0) {
+        fprintf(stderr, "Failed to control hub %s port %d power: %s\n",
+            hubs[pair[0]].location, port, libusb_error_name(rc));
+    } else if (opt_dry_run) {
+        printf("Dry run: not waiting for device\n");
+    } else {
+        printf("Hub %s port %d: off for %.3f ms", hubs[pair[0]].location,
+            port, (on - off) / 1000.0);
+        if (gone != 0)
+            printf(", device gone after %.3f ms", (gone - off) / 1000.0);
+        if (back != 0)
+            printf(", back %.3f ms after power on", (back - on) / 1000.0);
+        printf("\n");
+        if (back == 0 && gone == 0) {
+            fprintf(stderr, "Device did not disappear, hub may not cut port power!\n");
+            rc = -1;
+        } else if (back == 0) {
+            fprintf(stderr, "Device did not come back within %.3f sec!\n",
+                opt_timeout / 1000000.0);
+            rc = -1;
+        }
+    }
+    for (h=0; h<n; h++) {
+        print_hub_status("New", &hubs[pair[h]], devh[h], 1 << (port-1));
+        libusb_close(devh[h]);
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+
+/*
+ * Load hub quirks from file. Every line has hub VID:PID
+ * (or VID:PID@location for specific hub) followed
+ * by key=value settings, for example:
+ *   2109:2811 repeat=2 wait=50 settle=100 dual=1
+ */
+
+static int load_quirks(const char* filename)
+{
+    char line[256];
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char* tok = strtok(line, " \t\r\n");
+        if (tok == NULL || tok[0] == '#')
+            continue;
+        if (file_quirk_count >= MAX_QUIRKS) {
+            fprintf(stderr, "Too many quirks in %s\n", filename);
+            break;
+        }
+        struct hub_quirk * q = &file_quirks[file_quirk_count++];
+        snprintf(q->id, sizeof(q->id), "%s", tok);
+        q->repeat = q->wait = q->settle = q->dual = -1;
+        while ((tok = strtok(NULL, " \t\r\n")) != NULL && tok[0] != '#') {
+            char* value = strchr(tok, '=');
+            if (value != NULL)
+                *value++ = 0;
+            if (value == NULL || !isdigit((unsigned char)value[0])) {
+                fprintf(stderr, "Invalid quirk %s for %s\n", tok, q->id);
+            } else if (!strcasecmp(tok, "repeat")) {
+                q->repeat = atoi(value);
+            } else if (!strcasecmp(tok, "wait")) {
+                q->wait = atoi(value);
+            } else if (!strcasecmp(tok, "settle")) {
+                q->settle = atoi(value);
+            } else if (!strcasecmp(tok, "dual")) {
+                q->dual = atoi(value);
+            } else {
+                fprintf(stderr, "Unknown quirk %s for %s\n", tok, q->id);
+            }
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/*
+ * Set per-hub timing and dual hub behavior: options given on
+ * command line win, then quirks for this hub (from calibration),
+ * then quirks for hub model, then defaults.
+ */
+
+static void apply_quirks(struct hub_info * hub)
+{
+    const struct hub_quirk * q = NULL;
+    char id[64];
+    int i;
+    snprintf(id, sizeof(id), "%s@%s", hub->vendor, hub->location);
+    for (i = 0; i < file_quirk_count && q == NULL; i++) {
+        if (!strcasecmp(file_quirks[i].id, id))
+            q = &file_quirks[i];
+    }
+    for (i = 0; i < file_quirk_count && q == NULL; i++) {
+        if (!strcasecmp(file_quirks[i].id, hub->vendor))
+            q = &file_quirks[i];
+    }
+    hub->repeat  = opt_repeat;
+    hub->wait    = opt_wait;
+    /* USB3 hubs need extra delay to actually turn off */
+    hub->settle  = hub->bcd_usb >= USB_SS_BCD ? 150 : 0;
+    hub->no_dual = 0;
+    if (q == NULL)
+        return;
+    if (q->repeat >= 0 && !opt_repeat_set)
+        hub->repeat = q->repeat;
+    if (q->wait >= 0 && !opt_wait_set)
+        hub->wait = q->wait;
+    if (q->settle >= 0)
+        hub->settle = q->settle;
+    if (q->dual == 0)
+        hub->no_dual = 1;
+}
+
+
+/*
+ * Return bitmask of port_conditions[] which hold for given port
+ * of given hub, or -1 if port status cannot be read.
+ */
+
+static int port_conditions_mask(struct libusb_device_handle *devh,
+                                struct hub_info * hub, int port)
+{
+    int change = 0;
+    int status = get_port_status_change(devh, port, &change);
+    int mask = 0;
+    unsigned j;
+    if (status < 0)
+        return -1;
+    if (hub->bcd_usb >= USB_SS_BCD) {
+        /* convert to USB2 layout */
+        int usb2 = status & USB_SS_PORT_STAT_MASK;
+        if (status & USB_SS_PORT_STAT_POWER)
+            usb2 |= USB_PORT_STAT_POWER;
+        if ((status & USB_PORT_STAT_LINK_STATE) == USB_SS_PORT_LS_U3)
+            usb2 |= USB_PORT_STAT_SUSPEND;
+        status = usb2;
+    }
+    for (j = 0; j < sizeof(port_conditions)/sizeof(port_conditions[0]); j++) {
+        if ((status & port_conditions[j].status) ||
+            (change & port_conditions[j].change))
+        {
+            mask |= 1 << j;
+        }
+    }
+    return mask;
+}
+
+
+/*
+ * Read conditions of all ports of hubs opened in devhs[]
+ * into conditions[][] as bitmask of port_conditions[].
+ * Port of USB2/USB3 dual hub pair is seen as one port:
+ * condition holds if it holds on either hub.
+ * present bit is added to all ports as is.
+ */
+
+static void read_conditions(struct libusb_device_handle ** devhs,
+                            int conditions[][MAX_HUB_PORTS+1], int present)
+{
+    int raw[MAX_HUBS][MAX_HUB_PORTS+1];
+    int i, port;
+    for (i=0; i<hub_count; i++) {
+        for (port=1; port <= MAX_HUB_PORTS; port++)
+            raw[i][port] = 0;
+        if (devhs[i] == NULL)
+            continue;
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+            int mask = port_conditions_mask(devhs[i], &hubs[i], port);
+            raw[i][port] = mask < 0 ? 0 : mask;
+        }
+    }
+    for (i=0; i<hub_count; i++) {
+        int dual = hubs[i].dual;
+        for (port=1; port <= MAX_HUB_PORTS; port++) {
+            conditions[i][port] = raw[i][port] | present;
+            if (dual >= 0 && devhs[dual] != NULL && port <= hubs[dual].nports)
+                conditions[i][port] |= raw[dual][port];
+        }
+    }
+}
+
+
+/*
+ * Evaluate --where predicate for all ports of all selected hubs
+ * at once, before any action.
+ * Returns number of matching ports, or -1 if predicate is invalid.
+ */
+
+static int evaluate_where()
+{
+    struct libusb_device_handle * devhs[MAX_HUBS] = {NULL};
+    int conditions[MAX_HUBS][MAX_HUB_PORTS+1];
+    int present_bit = 1 << find_condition("present");
+    int present = 0;
+    int total = 0;
+    int i, port;
+    for (i=0; i<opt_where_count; i++) {
+        if (((opt_where[i].set | opt_where[i].clear) & present_bit) && !opt_device_set) {
+            fprintf(stderr, "Condition present needs -V device!\n");
+            return -1;
+        }
+    }
+    for (i=0; i<hub_count; i++) {
+        if (hubs[i].actionable && libusb_open(hubs[i].dev, &devhs[i]) != 0)
+            devhs[i] = NULL;
+    }
+    if (opt_device_set && count_devices(&opt_device) > 0)
+        present = present_bit;
+    read_conditions(devhs, conditions, present);
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] != NULL)
+            libusb_close(devhs[i]);
+    }
+    for (i=0; i<hub_count; i++) {
+        hubs[i].where_ports = 0;
+        if (!hubs[i].actionable)
+            continue;
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+            if (condition_match(conditions[i][port], opt_where, opt_where_count))
+                hubs[i].where_ports |= 1 << (port-1);
+        }
+        if (hub_ports(&hubs[i]) == 0)
+            continue;
+        printf("Hub %s ports matching condition:", hubs[i].location);
+        for (port=1; port <= hubs[i].nports; port++) {
+            if (hub_ports(&hubs[i]) & (1 << (port-1))) {
+                printf(" %d", port);
+                total++;
+            }
+        }
+        printf("\n");
+    }
+    return total;
+}
+
+
+/*
+ * Wait until --until predicate holds on any selected port of actionable
+ * hubs, or opt_timeout expires. Hubs stay open, so every check costs
+ * one GET_STATUS per port and no enumeration. Checks are woken up by
+ * hotplug events (device arrived or left), and also done every
+ * WAIT_POLL_INTERVAL for changes which produce no events (power,
+ * over-current). Device list for present condition is fetched again
+ * only after hotplug event, if hotplug is supported.
+ * Dry run checks predicate once and does not wait.
+ * Returns 0 if predicate holds, or -1 on timeout.
+ */
+
+static int wait_condition()
+{
+    struct libusb_device_handle * devhs[MAX_HUBS] = {NULL};
+    int conditions[MAX_HUBS][MAX_HUB_PORTS+1];
+    int present_bit = 1 << find_condition("present");
+    int present = 0;
+    int device_only = 1; /* predicate does not depend on ports */
+    int events = 1;
+    int met = 0;
+    int i, j, port;
+    int64_t start = time_us();
+    int64_t deadline = start + opt_timeout;
+
+    if (opt_until_count == 0) {
+        if (!opt_device_set) {
+            fprintf(stderr, "Use -U to specify condition or -V device to wait for!\n");
+            return -1;
+        }
+        opt_until[0].set   = present_bit;
+        opt_until[0].clear = 0;
+        opt_until_count = 1;
+    }
+    for (j=0; j<opt_until_count; j++) {
+        if ((opt_until[j].set | opt_until[j].clear) & ~present_bit)
+            device_only = 0;
+        if (((opt_until[j].set | opt_until[j].clear) & present_bit) && !opt_device_set) {
+            fprintf(stderr, "Condition present needs -V device!\n");
+            return -1;
+        }
+    }
+    for (i=0; i<hub_count && !device_only; i++) {
+        if (hubs[i].actionable && libusb_open(hubs[i].dev, &devhs[i]) != 0)
+            devhs[i] = NULL;
+    }
+
+    wait_events_start(device_only ? &opt_device : NULL);
+    for (;;) {
+        if (events && opt_device_set)
+            present = count_devices(&opt_device) > 0 ? present_bit : 0;
+        int64_t now = time_us();
+        if (device_only) {
+            met = condition_match(present, opt_until, opt_until_count);
+            if (met)
+                printf("Condition met after %.3f ms\n", (now - start) / 1000.0);
+        } else {
+            read_conditions(devhs, conditions, present);
+        }
+        for (i=0; i<hub_count && !device_only; i++) {
+            int dual = hubs[i].dual;
+            if (devhs[i] == NULL)
+                continue;
+            /* port of dual hub pair is checked once */
+            if (dual >= 0 && dual < i && devhs[dual] != NULL)
+                continue;
+            for (port=1; port <= hubs[i].nports; port++) {
+                if (!((1 << (port-1)) & hub_ports(&hubs[i])))
+                    continue;
+                if (!condition_match(conditions[i][port], opt_until, opt_until_count))
+                    continue;
+                printf("Condition met after %.3f ms on hub %s port %d\n",
+                    (now - start) / 1000.0, hubs[i].location, port);
+                met = 1;
+            }
+        }
+        if (met || opt_dry_run || now >= deadline)
+            break;
+        events = wait_event(deadline);
+    }
+    wait_events_stop();
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] != NULL)
+            libusb_close(devhs[i]);
+    }
+    if (met)
+        return 0;
+    if (opt_dry_run) {
+        printf("Dry run: condition does not hold now, not waiting\n");
+        return -1;
+    }
+    fprintf(stderr, "Condition not met within %.3f sec!\n", opt_timeout / 1000000.0);
+    return -1;
+}
+
+
+/*
+ * Step of sequence script or dependency graph, see parse_script().
+ */
+
+#define STEP_POWER      0  /* on, off, cycle or toggle */
+#define STEP_PORT       1  /* reset, suspend or resume */
+#define STEP_SLEEP      2
+#define STEP_AT         3
+#define STEP_WAIT_PORT  4
+#define STEP_WAIT_DEV   5
+
+/* State of step in dependency graph */
+#define NODE_PENDING    0
+#define NODE_RUNNING    1
+#define NODE_DONE       2
+#define NODE_FAILED     3  /* failed, or skipped because dependency failed */
+
+#define MAX_SCRIPT_STEPS 256
+#define MAX_STEP_DEPS    8
+
+struct script_step {
+    int line;
+    int type;
+    int action;       /* POWER_xxx or PORT_xxx */
+    int hub;          /* index in hubs[], or -1 for all actionable hubs */
+    int ports;        /* bitmask of ports */
+    int64_t time;     /* sleep, at time, cycle delay or wait timeout in us */
+    struct condition_term terms[MAX_WHERE_TERMS];
+    int term_count;
+    struct device_spec device; /* for wait device */
+    char text[128];   /* step as written, for reporting */
+    /* dependency graph only */
+    char name[32];
+    char after[128];  /* comma separated names of steps it depends on */
+    int deps[MAX_STEP_DEPS];
+    int dep_count;
+    int state;
+    int64_t started;
+    int64_t deadline;
+    int64_t finished;
+    /* power or port action in progress, see step_ports_action() */
+    int current;            /* action being done */
+    int phase;              /* 1 when cycle is powering back on */
+    int round;              /* power off requests sent to pending ports */
+    int pending[MAX_HUBS];  /* ports with request to repeat or to complete */
+    int64_t switched;       /* when action was started */
+    int64_t next;           /* when action needs attention again */
+};
+
+static struct script_step script_steps[MAX_SCRIPT_STEPS];
+static int script_step_count = 0;
+
+
+/*
+ * Parse "[LOC:]PORTS" into step hub and ports.
+ * Returns 0, or -1 if it is not valid.
+ */
+
+static int parse_step_ports(const char* str, struct script_step * step)
+{
+    const char* colon = strrchr(str, ':');
+    int i;
+    step->hub = -1;
+    if (colon != NULL) {
+        for (i=0; i<hub_count; i++) {
+            if (hubs[i].actionable &&
+                strlen(hubs[i].location) == (size_t)(colon - str) &&
+                !strncasecmp(hubs[i].location, str, colon - str))
+                break;
+        }
+        if (i == hub_count) {
+            fprintf(stderr, "Script line %d: hub %.*s is not selected\n",
+                step->line, (int)(colon - str), str);
+            return -1;
+        }
+        step->hub = i;
+        str = colon + 1;
+    } else if (hub_phys_count > 1 && strlen(opt_location) == 0) {
+        fprintf(stderr, "Script line %d: use LOC:PORTS or -l to select hub\n",
+            step->line);
+        return -1;
+    }
+    step->ports = parse_ports(str);
+    return step->ports < 0 ? -1 : 0;
+}
+
+
+/*
+ * Resolve step names in "after" lists of dependency graph into
+ * deps[], and check that graph has no cycles.
+ * Returns 0, or -1 if graph is not valid.
+ */
+
+static int resolve_graph()
+{
+    int indegree[MAX_SCRIPT_STEPS];
+    int queue[MAX_SCRIPT_STEPS];
+    int head = 0, tail = 0;
+    int s, t, d;
+    for (s=0; s<script_step_count; s++) {
+        struct script_step * step = &script_steps[s];
+        for (t=0; t<s; t++) {
+            if (!strcmp(script_steps[t].name, step->name)) {
+                fprintf(stderr, "Script line %d: step %s is already defined\n",
+                    step->line, step->name);
+                return -1;
+            }
+        }
+        char* name = strtok(step->after, ",");
+        while (name != NULL) {
+            for (t=0; t<script_step_count; t++) {
+                if (!strcmp(script_steps[t].name, name))
+                    break;
+            }
+            if (t == script_step_count || step->dep_count >= MAX_STEP_DEPS) {
+                fprintf(stderr, "Script line %d: %s step %s\n", step->line,
+                    t == script_step_count ? "unknown" : "too many dependencies at",
+                    name);
+                return -1;
+            }
+            step->deps[step->dep_count++] = t;
+            name = strtok(NULL, ",");
+        }
+    }
+    /* Kahn's algorithm: every step must become ready at some point */
+    for (s=0; s<script_step_count; s++) {
+        indegree[s] = script_steps[s].dep_count;
+        if (indegree[s] == 0)
+            queue[tail++] = s;
+    }
+    while (head < tail) {
+        int done = queue[head++];
+        for (s=0; s<script_step_count; s++) {
+            for (d=0; d<script_steps[s].dep_count; d++) {
+                if (script_steps[s].deps[d] == done && --indegree[s] == 0)
+                    queue[tail++] = s;
+            }
+        }
+    }
+    if (tail < script_step_count) {
+        fprintf(stderr, "Script has dependency cycle\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Parse sequence script: one step per line, # starts comment.
+ * Steps are
+ *   on|off|toggle|reset|suspend|resume [LOC:]PORTS
+ *   cycle [LOC:]PORTS [DELAY]
+ *   sleep DURATION
+ *   at TIME
+ *   wait [LOC:]PORTS CONDITION [TIMEOUT]
+ *   wait device VID:PID[/SERIAL] [TIMEOUT]
+ * For dependency graph, every step is prefixed with "NAME:" and
+ * may be followed by "after NAME[,NAME...]".
+ * All steps are parsed before anything is done, so that script
+ * with error does not leave ports half way.
+ * Returns number of steps, or -1 if script is not valid.
+ */
+
+static int parse_script(const char* filename, int graph)
+{
+    char line[256];
+    int lineno = 0;
+    int failed = 0;
+    FILE* f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    script_step_count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char* all[8];
+        char** tok = all;
+        int n = 0;
+        lineno++;
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = 0;
+        rtrim(line);
+        struct script_step * step = &script_steps[script_step_count];
+        char text[sizeof(step->text)];
+        snprintf(text, sizeof(text), "%s", line + strspn(line, " \t"));
+        char* p = strtok(line, " \t");
+        while (p != NULL && n < 8) {
+            tok[n++] = p;
+            p = strtok(NULL, " \t");
+        }
+        if (n == 0)
+            continue;
+        if (script_step_count >= MAX_SCRIPT_STEPS) {
+            fprintf(stderr, "Script has more than %d steps\n", MAX_SCRIPT_STEPS);
+            failed = 1;
+            break;
+        }
+        memset(step, 0, sizeof(*step));
+        step->line = lineno;
+        step->hub  = -1;
+        strcpy(step->text, text);
+        if (graph) {
+            size_t len = strlen(tok[0]);
+            if (n < 2 || len < 2 || len > sizeof(step->name) ||
+                tok[0][len-1] != ':')
+            {
+                fprintf(stderr, "Script line %d: step must start with NAME:\n", lineno);
+                failed = 1;
+                continue;
+            }
+            memcpy(step->name, tok[0], len-1);
+            if (n >= 4 && !strcasecmp(tok[n-2], "after")) {
+                snprintf(step->after, sizeof(step->after), "%s", tok[n-1]);
+                n -= 2;
+            }
+            tok++;
+            n--;
+        }
+        int ok = 0;
+        int action = parse_action(tok[0]);
+        if (action >= POWER_OFF && action <= POWER_TOGGLE) {
+            step->type   = STEP_POWER;
+            step->action = action;
+            step->time   = opt_delay;
+            ok = (n == 2 || (n == 3 && action == POWER_CYCLE)) &&
+                 parse_step_ports(tok[1], step) == 0 &&
+                 (n == 2 || (step->time = parse_duration(tok[2])) >= 0);
+        } else if (action == PORT_RESET || action == PORT_SUSPEND ||
+                   action == PORT_RESUME)
+        {
+            step->type   = STEP_PORT;
+            step->action = action;
+            ok = n == 2 && parse_step_ports(tok[1], step) == 0;
+        } else if (!strcasecmp(tok[0], "sleep") || !strcasecmp(tok[0], "at")) {
+            step->type = strcasecmp(tok[0], "sleep") ? STEP_AT : STEP_SLEEP;
+            ok = n == 2 && (step->time = parse_duration(tok[1])) >= 0;
+        } else if (!strcasecmp(tok[0], "wait") && n >= 3 && n <= 4) {
+            step->time = opt_timeout;
+            if (n == 4 && (step->time = parse_duration(tok[3])) < 0) {
+                ok = 0;
+            } else if (!strcasecmp(tok[1], "device")) {
+                step->type = STEP_WAIT_DEV;
+                ok = parse_device(tok[2], &step->device) == 0;
+            } else {
+                int j;
+                step->type = STEP_WAIT_PORT;
+                step->term_count = parse_condition(tok[2], step->terms);
+                ok = step->term_count > 0 && parse_step_ports(tok[1], step) == 0;
+                /* device presence is waited for with wait device */
+                for (j=0; j<step->term_count; j++) {
+                    if ((step->terms[j].set | step->terms[j].clear) &
+                        (1 << find_condition("present")))
+                        ok = 0;
+                }
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "Script line %d: invalid step: %s\n", lineno, step->text);
+            failed = 1;
+            continue;
+        }
+        script_step_count++;
+    }
+    if (f != stdin)
+        fclose(f);
+    if (!failed && graph && resolve_graph() < 0)
+        failed = 1;
+    return failed ? -1 : script_step_count;
+}
+
+
+/*
+ * Start power action (off, on or toggle) or port action
+ * (reset, suspend or resume) on all ports of step. Power of dual hub
+ * port is switched on both hubs. Ports whose power off request has
+ * to be repeated, or whose suspend or resume is not complete yet, are
+ * left in step->pending for step_ports_progress(), due at step->next.
+ * Device reset is done right away.
+ * Returns 0 on success or libusb error code.
+ */
+
+static int step_ports_action(struct libusb_device_handle ** devhs,
+                             struct script_step * step, int action)
+{
+    int64_t now = time_us();
+    int wait = 0;
+    int rc = 0;
+    int i, h, port;
+    step->current  = action;
+    step->round    = 1;
+    step->switched = now;
+    memset(step->pending, 0, sizeof(step->pending));
+    for (i=0; i<hub_count && rc >= 0; i++) {
+        if (devhs[i] == NULL)
+            continue;
+        if (step->hub >= 0 && step->hub != i)
+            continue;
+        /* power of dual hub port is switched together with its partner */
+        if (step->type == STEP_POWER && step->hub < 0 && hubs[i].dual >= 0 &&
+            hubs[i].dual < i && devhs[hubs[i].dual] != NULL)
+            continue;
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS && rc >= 0; port++) {
+            if (!(step->ports & (1 << (port-1))))
+                continue;
+            if (step->type == STEP_PORT) {
+                int port_status = get_port_status(devhs[i], port);
+                int suspended = port_suspended(&hubs[i], port_status);
+                if (port_status < 0 || !(port_status & USB_PORT_STAT_CONNECTION))
+                    continue;
+                if (action == PORT_RESET) {
+                    /* device reset is done by OS and blocks */
+                    rc = reset_port(devhs[i], &hubs[i], port);
+                    continue;
+                } else if (action == PORT_SUSPEND && !suspended)
+                    rc = start_port_suspend(devhs[i], &hubs[i], port, 1);
+                else if (action == PORT_RESUME && suspended)
+                    rc = start_port_suspend(devhs[i], &hubs[i], port, 0);
+                else
+                    continue;
+                if (rc >= 0 && !opt_dry_run) { /* completion is not simulated */
+                    step->pending[i] |= 1 << (port-1);
+                    wait = 1;
+                }
+                continue;
+            }
+            int on = action == POWER_ON;
+            if (action == POWER_TOGGLE) {
+                on = toggle_target(devhs, i, port);
+                if (on < 0) {
+                    rc = on;
+                    break;
+                }
+            }
+            int pair[2] = { i, hubs[i].dual };
+            for (h=0; h<2 && rc >= 0; h++) {
+                if (pair[h] < 0 || devhs[pair[h]] == NULL || port > hubs[pair[h]].nports)
+                    continue;
+                rc = set_port_power(devhs[pair[h]], port, on);
+                if (rc >= 0 && !on && hubs[pair[h]].repeat > 1) {
+                    step->pending[pair[h]] |= 1 << (port-1);
+                    if (hubs[pair[h]].wait > wait)
+                        wait = hubs[pair[h]].wait;
+                }
+            }
+        }
+    }
+    step->next = now + (int64_t)wait * 1000;
+    return rc;
+}
+
+
+/*
+ * Continue action started with step_ports_action() once step->next
+ * has come: repeat power off requests as hubs need them, or check
+ * if port actions are complete. Nothing blocks, so that dependency
+ * graph can run other steps in the meantime.
+ * Returns 1 when action is complete, 0 if it is still in progress,
+ * or libusb error code.
+ */
+
+static int step_ports_progress(struct libusb_device_handle ** devhs,
+                               struct script_step * step)
+{
+    int64_t now = time_us();
+    int wait = 1; /* ms between port action completion checks */
+    int busy = 0;
+    int rc = 0;
+    int i, port;
+    if (now < step->next)
+        return 0;
+    for (i=0; i<hub_count; i++) {
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+            if (!(step->pending[i] & (1 << (port-1))))
+                continue;
+            if (step->type == STEP_POWER) {
+                rc = set_port_power(devhs[i], port, 0);
+                if (step->round + 1 < hubs[i].repeat) {
+                    busy = 1;
+                    if (hubs[i].wait > wait)
+                        wait = hubs[i].wait;
+                } else {
+                    step->pending[i] &= ~(1 << (port-1));
+                }
+            } else {
+                rc = check_port_suspend(devhs[i], &hubs[i], port,
+                    step->current == PORT_SUSPEND, step->switched);
+                if (rc > 0)
+                    step->pending[i] &= ~(1 << (port-1));
+                else if (rc == 0)
+                    busy = 1;
+            }
+            if (rc < 0)
+                return rc;
+        }
+    }
+    step->round++;
+    if (!busy)
+        return 1;
+    step->next = now + (int64_t)wait * 1000;
+    return 0;
+}
+
+
+/*
+ * Do power or port action on all ports of step of sequence script,
+ * waiting until it is complete.
+ * Returns 0 on success or libusb error code.
+ */
+
+static int step_ports_run(struct libusb_device_handle ** devhs,
+                          struct script_step * step, int action)
+{
+    int rc = step_ports_action(devhs, step, action);
+    while (rc == 0) {
+        sleep_until_us(step->next);
+        rc = step_ports_progress(devhs, step);
+    }
+    return rc < 0 ? rc : 0;
+}
+
+
+/*
+ * Check if condition of wait step holds on any of its ports.
+ */
+
+static int step_condition_met(struct libusb_device_handle ** devhs,
+                              struct script_step * step)
+{
+    int conditions[MAX_HUBS][MAX_HUB_PORTS+1];
+    int i, port;
+    read_conditions(devhs, conditions, 0);
+    for (i=0; i<hub_count; i++) {
+        if (devhs[i] == NULL || (step->hub >= 0 && step->hub != i))
+            continue;
+        for (port=1; port <= hubs[i].nports; port++) {
+            if ((step->ports & (1 << (port-1))) &&
+                condition_match(conditions[i][port], step->terms, step->term_count))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Report failure of step with libusb error code rc.
+ */
+
+static void step_failed(struct script_step * step, int rc)
+{
+    fprintf(stderr, "Script line %d: %s failed: %s\n",
+        step->line, step->text, libusb_error_name(rc));
+}
+
+
+/*
+ * Run one step of sequence script. t0 is time when script started.
+ * Returns 0 on success or -1 on failure.
+ */
+
+static int run_step(struct libusb_device_handle ** devhs,
+                    struct script_step * step, int64_t t0)
+{
+    int64_t start = time_us();
+    int64_t deadline = start + step->time;
+    int rc = 0;
+
+    if (step->type == STEP_SLEEP) {
+        sleep_until_us(start + step->time);
+        return 0;
+    }
+    if (step->type == STEP_AT) {
+        sleep_until_us(t0 + step->time);
+        return 0;
+    }
+    if (opt_dry_run && (step->type == STEP_WAIT_DEV || step->type == STEP_WAIT_PORT)) {
+        printf("  [%10.3f ms] dry run: not waiting\n", (start - t0) / 1000.0);
+        return 0;
+    }
+    if (step->type == STEP_WAIT_DEV) {
+        wait_events_start(&step->device);
+        while (count_devices(&step->device) <= 0) {
+            if (time_us() >= deadline) {
+                rc = -1;
+                break;
+            }
+            while (!wait_event(deadline) && time_us() < deadline);
+        }
+        wait_events_stop();
+        if (rc < 0) {
+            fprintf(stderr, "Script line %d: device did not appear within %.3f sec\n",
+                step->line, step->time / 1000000.0);
+            return -1;
+        }
+        printf("  [%10.3f ms] device present after %.3f ms\n",
+            (time_us() - t0) / 1000.0, (time_us() - start) / 1000.0);
+        return 0;
+    }
+    if (step->type == STEP_WAIT_PORT) {
+        int met = 0;
+        wait_events_start(NULL);
+        for (;;) {
+            met = step_condition_met(devhs, step);
+            if (met || time_us() >= deadline)
+                break;
+            wait_event(deadline);
+        }
+        wait_events_stop();
+        if (!met) {
+            fprintf(stderr, "Script line %d: condition not met within %.3f sec\n",
+                step->line, step->time / 1000000.0);
+            return -1;
+        }
+        printf("  [%10.3f ms] condition met after %.3f ms\n",
+            (time_us() - t0) / 1000.0, (time_us() - start) / 1000.0);
+        return 0;
+    }
+
+    if (step->type == STEP_POWER && step->action == POWER_CYCLE) {
+        /* all ports of the step are switched off together, then on */
+        rc = step_ports_run(devhs, step, POWER_OFF);
+        if (rc >= 0) {
+            sleep_until_us(start + step->time);
+            rc = step_ports_run(devhs, step, POWER_ON);
+        }
+    } else {
+        rc = step_ports_run(devhs, step, step->action);
+    }
+    if (rc < 0) {
+        step_failed(step, rc);
+        return -1;
     }
-    snprintf(description, desc_len,
-        "%04x:%04x%s%s%s%s%s%s%s",
-        id_vendor, id_product,
-        vendor[0]  ? " " : "", vendor,
-        product[0] ? " " : "", product,
-        serial[0]  ? " " : "", serial,
-        ports
-    );
     return 0;
 }
 
 
 /*
- * show status for hub ports
- * portmask is bitmap of ports to display
- * if portmask is 0, show all ports
+ * Run sequence script from file (- for stdin) with all selected hubs
+ * opened once. Steps run one after another, each is reported with time
+ * since script start. Script stops at first failed step.
+ * Returns 0 on success or -1 on failure.
  */
 
-static int print_port_status(struct hub_info * hub, int portmask)
+static int run_script(const char* filename)
 {
-    int port_status;
-    struct libusb_device_handle * devh = NULL;
+    struct libusb_device_handle * devhs[MAX_HUBS];
     int rc = 0;
-    struct libusb_device *dev = hub->dev;
-    rc = libusb_open(dev, &devh);
-    if (rc == 0) {
-        int port;
-        for (port = 1; port <= hub->nports; port++) {
-            if (portmask > 0 && (portmask & (1 << (port-1))) == 0) continue;
+    int s;
 
-            port_status = get_port_status(devh, port);
-            if (port_status == -1) {
-                fprintf(stderr,
-                    "cannot read port %d status, %s (%d)\n",
-                    port, strerror(errno), errno);
-                break;
-            }
+    if (parse_script(filename, 0) < 0)
+        return -1;
+    open_hubs(devhs);
+    int64_t t0 = time_us();
+    for (s=0; s<script_step_count && rc == 0; s++) {
+        printf("  [%10.3f ms] line %d: %s\n", (time_us() - t0) / 1000.0,
+            script_steps[s].line, script_steps[s].text);
+        rc = run_step(devhs, &script_steps[s], t0);
+    }
+    printf("Script %s after %.3f ms\n", rc == 0 ? "done" : "stopped",
+        (time_us() - t0) / 1000.0);
+    close_hubs(devhs, 1);
+    return rc;
+}
 
-            printf("  Port %d: %04x", port, port_status);
 
-            char description[256] = "";
-            struct libusb_device * udev;
-            int i = 0;
-            while ((udev = usb_devs[i++]) != NULL) {
-                if (libusb_get_parent(udev)      == dev &&
-                    libusb_get_port_number(udev) == port)
-                {
-                    rc = get_device_description(udev, description, sizeof(description));
-                    if (rc == 0)
-                        break;
-                }
+/*
+ * Start step of dependency graph whose dependencies are done.
+ * Power and port actions send their first requests right away,
+ * all steps then keep running until check_node() finishes them.
+ */
+
+static void start_node(struct libusb_device_handle ** devhs,
+                       struct script_step * step, int64_t t0)
+{
+    int rc = 0;
+    step->started = time_us();
+    step->deadline = step->started + step->time;
+    step->state = NODE_RUNNING;
+    printf("  [%10.3f ms] %s started\n", (step->started - t0) / 1000.0, step->name);
+    if (step->type == STEP_AT)
+        step->deadline = t0 + step->time;
+    if (step->type == STEP_POWER || step->type == STEP_PORT) {
+        step->phase = 0;
+        rc = step_ports_action(devhs, step,
+            step->type == STEP_POWER && step->action == POWER_CYCLE ? POWER_OFF
+                                                                    : step->action);
+        step->deadline = step->next;
+    }
+    if (rc < 0) {
+        step_failed(step, rc);
+        step->state = NODE_FAILED;
+    }
+}
+
+
+/*
+ * Check running step of dependency graph: finish it if its time
+ * has come, its condition holds or its requests are complete,
+ * or fail it on timeout. Step deadline is set to time when it
+ * needs to be checked again (repeated power off request, cycle
+ * delay, port action completion check or wait timeout).
+ * Device list is looked at only if events is set.
+ */
+
+static void check_node(struct libusb_device_handle ** devhs,
+                       struct script_step * step, int events)
+{
+    int64_t now = time_us();
+    int rc = 0;
+    if (step->type == STEP_SLEEP || step->type == STEP_AT) {
+        if (now >= step->deadline)
+            step->state = NODE_DONE;
+    } else if (step->type == STEP_POWER || step->type == STEP_PORT) {
+        rc = step_ports_progress(devhs, step);
+        if (rc > 0 && step->type == STEP_POWER &&
+            step->action == POWER_CYCLE && step->phase == 0)
+        {
+            /* cycle: power back on after delay */
+            rc = 0;
+            if (now >= step->started + step->time) {
+                step->phase = 1;
+                rc = step_ports_action(devhs, step, POWER_ON);
+            } else {
+                step->next = step->started + step->time;
             }
+        }
+        if (rc > 0)
+            step->state = NODE_DONE;
+        step->deadline = step->next;
+    } else if (opt_dry_run) {
+        printf("  %s: dry run: not waiting\n", step->name);
+        step->state = NODE_DONE;
+    } else if (step->type == STEP_WAIT_PORT) {
+        if (step_condition_met(devhs, step))
+            step->state = NODE_DONE;
+    } else if (step->type == STEP_WAIT_DEV && events) {
+        if (count_devices(&step->device) > 0)
+            step->state = NODE_DONE;
+    }
+    if (step->state == NODE_RUNNING && now >= step->deadline &&
+        (step->type == STEP_WAIT_PORT || step->type == STEP_WAIT_DEV))
+    {
+        fprintf(stderr, "Script line %d: %s timed out after %.3f sec\n",
+            step->line, step->name, step->time / 1000000.0);
+        step->state = NODE_FAILED;
+    }
+    if (rc < 0) {
+        step_failed(step, rc);
+        step->state = NODE_FAILED;
+    }
+}
 
-            if (hub->bcd_usb < USB_SS_BCD) {
-                if (port_status == 0) {
-                    printf(" off");
-                } else {
-                    if (port_status & USB_PORT_STAT_POWER)        printf(" power");
-                    if (port_status & USB_PORT_STAT_INDICATOR)    printf(" indicator");
-                    if (port_status & USB_PORT_STAT_TEST)         printf(" test");
-                    if (port_status & USB_PORT_STAT_HIGH_SPEED)   printf(" highspeed");
-                    if (port_status & USB_PORT_STAT_LOW_SPEED)    printf(" lowspeed");
-                    if (port_status & USB_PORT_STAT_SUSPEND)      printf(" suspend");
+
+/*
+ * Run dependency graph of steps from file (- for stdin):
+ * every step starts as soon as all steps it depends on are done,
+ * so independent branches proceed concurrently and whole graph
+ * takes time of its critical path. This is single event loop
+ * like staged_power_on(): only short port requests are sent
+ * synchronously, and sleeps, cycle delays, repeated power off
+ * requests, port reset/suspend completion and waits of all running
+ * steps are deadlines of the loop, so they overlap.
+ * If step fails, steps depending on it are skipped, but
+ * independent branches run to the end.
+ * Returns 0 on success or -1 on failure.
+ */
+
+static int run_graph(const char* filename)
+{
+    struct libusb_device_handle * devhs[MAX_HUBS];
+    int64_t total = 0;
+    int remaining;
+    int failed = 0;
+    int events = 1;
+    int s, d;
+
+    if (parse_script(filename, 1) < 0)
+        return -1;
+    open_hubs(devhs);
+    wait_events_start(NULL);
+    remaining = script_step_count;
+    int64_t t0 = time_us();
+    while (remaining > 0) {
+        int progress = 0;
+        int running = 0;
+        int64_t next = time_us() + WAIT_POLL_INTERVAL * 1000;
+        for (s=0; s<script_step_count; s++) {
+            struct script_step * step = &script_steps[s];
+            int just_started = 0;
+            if (step->state == NODE_PENDING) {
+                int ready = 1;
+                for (d=0; d<step->dep_count && ready; d++) {
+                    struct script_step * dep = &script_steps[step->deps[d]];
+                    if (dep->state == NODE_FAILED) {
+                        printf("  %s skipped: %s failed\n", step->name, dep->name);
+                        step->state = NODE_FAILED;
+                    }
+                    if (dep->state != NODE_DONE)
+                        ready = 0;
                 }
-            } else {
-                if (port_status == USB_SS_PORT_LS_SS_DISABLED) {
-                    printf(" off");
+                if (ready) {
+                    start_node(devhs, step, t0);
+                    just_started = 1;
+                }
+            }
+            if (step->state == NODE_RUNNING)
+                check_node(devhs, step, events || just_started);
+            if (step->state == NODE_RUNNING) {
+                running++;
+                if (step->deadline < next)
+                    next = step->deadline;
+            } else if (step->state != NODE_PENDING && step->finished == 0) {
+                /* step has just finished, failed or was skipped */
+                step->finished = time_us();
+                if (step->started == 0)
+                    step->started = step->finished;
+                total += step->finished - step->started;
+                if (step->state == NODE_DONE) {
+                    printf("  [%10.3f ms] %s done after %.3f ms\n",
+                        (step->finished - t0) / 1000.0, step->name,
+                        (step->finished - step->started) / 1000.0);
                 } else {
-                    int link_state = port_status & USB_PORT_STAT_LINK_STATE;
-                    if (port_status & USB_SS_PORT_STAT_POWER)     printf(" power");
-                    if ((port_status & USB_SS_PORT_STAT_SPEED)
-                         == USB_PORT_STAT_SPEED_5GBPS)
-                    {
-                        printf(" 5gbps");
-                    }
-                    if (link_state == USB_SS_PORT_LS_U0)          printf(" U0");
-                    if (link_state == USB_SS_PORT_LS_U1)          printf(" U1");
-                    if (link_state == USB_SS_PORT_LS_U2)          printf(" U2");
-                    if (link_state == USB_SS_PORT_LS_U3)          printf(" U3");
-                    if (link_state == USB_SS_PORT_LS_SS_DISABLED) printf(" SS.Disabled");
-                    if (link_state == USB_SS_PORT_LS_RX_DETECT)   printf(" Rx.Detect");
-                    if (link_state == USB_SS_PORT_LS_SS_INACTIVE) printf(" SS.Inactive");
-                    if (link_state == USB_SS_PORT_LS_POLLING)     printf(" Polling");
-                    if (link_state == USB_SS_PORT_LS_RECOVERY)    printf(" Recovery");
-                    if (link_state == USB_SS_PORT_LS_HOT_RESET)   printf(" HotReset");
-                    if (link_state == USB_SS_PORT_LS_COMP_MOD)    printf(" Compliance");
-                    if (link_state == USB_SS_PORT_LS_LOOPBACK)    printf(" Loopback");
+                    failed = 1;
                 }
+                remaining--;
+                progress = 1;
             }
-            if (port_status & USB_PORT_STAT_RESET)       printf(" reset");
-            if (port_status & USB_PORT_STAT_OVERCURRENT) printf(" oc");
-            if (port_status & USB_PORT_STAT_ENABLE)      printf(" enable");
-            if (port_status & USB_PORT_STAT_CONNECTION)  printf(" connect");
+        }
+        events = 0;
+        if (progress)
+            continue; /* steps depending on finished ones can start now */
+        if (running == 0)
+            break;
+        events = wait_event(next);
+    }
+    wait_events_stop();
+    printf("Graph %s after %.3f ms (%.3f ms if steps ran one by one)\n",
+        failed ? "failed" : "done", (time_us() - t0) / 1000.0, total / 1000.0);
+    close_hubs(devhs, 1);
+    return failed ? -1 : 0;
+}
 
-            if (port_status & USB_PORT_STAT_CONNECTION)  printf(" [%s]", description);
 
-            printf("\n");
+/*
+ * Print final outcome of every port whose last request failed
+ * (after retries). Returns number of such ports.
+ */
+
+static int report_port_errors()
+{
+    int failed = 0;
+    int i, port;
+    for (i=0; i<hub_count; i++) {
+        for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+            int rc = hubs[i].port_error[port];
+            if (rc == 0)
+                continue;
+            fprintf(stderr, "Hub %s port %d: failed with %s (%s) after %d attempt(s)\n",
+                hubs[i].location, port, libusb_error_name(rc),
+                is_transient_error(rc) ? "transient" : "permanent",
+                hubs[i].port_attempts[port]
+            );
+            failed++;
         }
-        libusb_close(devh);
     }
-    return 0;
+    return failed;
 }
 
 
@@ -573,11 +4761,13 @@ static int usb_find_hubs()
             perm_ok = 0; /* USB permission issue? */
         }
         get_device_description(dev, info.description, sizeof(info.description));
+        apply_quirks(&info);
         if (info.ppps) { /* PPPS is supported */
             if (hub_count < MAX_HUBS) {
                 info.actionable = 1;
+                info.dual = -1;
                 if (strlen(opt_location)>0) {
-                    if (strcasecmp(opt_location, info.location)) {
+                    if (!location_match(opt_location, info.location)) {
                        info.actionable = 0;
                     }
                 }
@@ -599,7 +4789,7 @@ static int usb_find_hubs()
         if (hubs[i].bcd_usb < USB_SS_BCD || opt_exact) {
             hub_phys_count++;
         }
-        if (opt_exact)
+        if (opt_exact || hubs[i].no_dual)
             continue;
         int match = -1;
         for (j=0; j<hub_count; j++) {
@@ -619,6 +4809,9 @@ static int usb_find_hubs()
                 (hubs[j].bcd_usb < USB_SS_BCD))
                 continue;
 
+            if (hubs[j].no_dual)
+                continue;
+
             /* But they must have the same vendor: */
             if (strncasecmp(hubs[i].vendor, hubs[j].vendor, 4))
                 continue;
@@ -637,8 +4830,11 @@ static int usb_find_hubs()
                 break;
             }
         }
-        if (match >= 0)
+        if (match >= 0) {
             hubs[match].actionable = 1;
+            hubs[i].dual = match;
+            hubs[match].dual = i;
+        }
     }
     if (perm_ok == 0 && hub_phys_count == 0) {
         return LIBUSB_ERROR_ACCESS;
@@ -654,7 +4850,7 @@ int main(int argc, char *argv[])
     int option_index = 0;
 
     for (;;) {
-        c = getopt_long(argc, argv, "l:n:a:p:d:r:w:hveR",
+        c = getopt_long(argc, argv, "l:n:a:p:d:r:w:A:B:E:c:t:S:L:M:Q:W:U:V:o:s:g:hveRyTCD",
             long_options, &option_index);
         if (c == -1)
             break;  /* no more options left */
@@ -675,38 +4871,92 @@ int main(int argc, char *argv[])
             strncpy(opt_vendor, optarg, sizeof(opt_vendor));
             break;
         case 'p':
+            opt_ports_set = 1;
             if (!strcasecmp(optarg, "all")) { /* all ports is the default */
                 break;
             }
             if (strlen(optarg)) {
                 /* parse port list */
-                opt_ports = 0;
-                size_t i;
-                for (i=0; i<strlen(optarg); i++) {
-                    if (!isdigit(optarg[i]) || optarg[i] == '0') {
-                        printf("%s must be list of ports 1 to %d\n", optarg, MAX_HUB_PORTS);
-                    }
-                    int d = optarg[i]-'1';
-                    opt_ports |= (1 << d);
+                opt_ports = parse_ports(optarg);
+                if (opt_ports < 0) {
+                    printf("%s must be list of ports 1 to %d\n", optarg, MAX_HUB_PORTS);
+                    exit(1);
                 }
             }
             break;
         case 'a':
-            if (!strcasecmp(optarg, "off")   || !strcasecmp(optarg, "0")) {
-                opt_action = POWER_OFF;
-            }
-            if (!strcasecmp(optarg, "on")    || !strcasecmp(optarg, "1")) {
-                opt_action = POWER_ON;
+            if (strchr(optarg, '=')) {
+                /* per-port actions */
+                opt_ports = parse_port_actions(optarg);
+                if (opt_ports < 0) {
+                    fprintf(stderr, "Invalid per-port actions %s\n", optarg);
+                    exit(1);
+                }
+                opt_action = POWER_MIXED;
+                break;
             }
-            if (!strcasecmp(optarg, "cycle") || !strcasecmp(optarg, "2")) {
-                opt_action = POWER_CYCLE;
+            opt_action = parse_action(optarg);
+            if (opt_action < POWER_OFF) {
+                fprintf(stderr, "Invalid action %s\n", optarg);
+                exit(1);
             }
             break;
         case 'd':
-            opt_delay = atoi(optarg);
+            opt_delay = parse_duration(optarg);
+            if (opt_delay < 0) {
+                fprintf(stderr, "Invalid delay %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            opt_period = parse_duration(optarg);
+            if (opt_period < 0) {
+                fprintf(stderr, "Invalid period %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            opt_count = parse_count(optarg);
+            if (opt_count <= 0) {
+                fprintf(stderr, "Invalid count %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            strncpy(opt_snapshot, optarg, sizeof(opt_snapshot) - 1);
+            break;
+        case 'L':
+            if (!strcasecmp(optarg, "off")) {
+                opt_u1_timeout = opt_u2_timeout = 0;
+            } else {
+                char* end;
+                opt_u1_timeout = opt_u2_timeout = strtol(optarg, &end, 0);
+                if (*end == ',')
+                    opt_u2_timeout = strtol(end + 1, &end, 0);
+                if (*end || opt_u1_timeout < 0 || opt_u1_timeout > 255 ||
+                    opt_u2_timeout < 0 || opt_u2_timeout > 255)
+                {
+                    fprintf(stderr, "Invalid LPM timeouts %s\n", optarg);
+                    exit(1);
+                }
+                /* U1 timeouts 0x80 to 0xfe are reserved */
+                if (opt_u1_timeout >= 0x80 && opt_u1_timeout < 0xff) {
+                    fprintf(stderr, "U1 timeout %d is reserved, use 0 to 127 or 255\n",
+                        opt_u1_timeout);
+                    exit(1);
+                }
+            }
+            break;
+        case 'M':
+            opt_residency = parse_duration(optarg);
+            if (opt_residency <= 0) {
+                fprintf(stderr, "Invalid sampling window %s\n", optarg);
+                exit(1);
+            }
             break;
         case 'r':
             opt_repeat = atoi(optarg);
+            opt_repeat_set = 1;
             break;
         case 'e':
             opt_exact = 1;
@@ -716,6 +4966,68 @@ int main(int argc, char *argv[])
             break;
         case 'w':
             opt_wait = atoi(optarg);
+            opt_wait_set = 1;
+            break;
+        case 'Q':
+            strncpy(opt_quirks, optarg, sizeof(opt_quirks) - 1);
+            break;
+        case 's':
+            strncpy(opt_script, optarg, sizeof(opt_script) - 1);
+            break;
+        case 'g':
+            strncpy(opt_graph, optarg, sizeof(opt_graph) - 1);
+            break;
+        case 'W':
+        case 'U':
+            rc = parse_condition(optarg, c == 'W' ? opt_where : opt_until);
+            if (rc < 0) {
+                fprintf(stderr, "Invalid condition %s, use", optarg);
+                unsigned j;
+                for (j = 0; j < sizeof(port_conditions)/sizeof(port_conditions[0]); j++)
+                    fprintf(stderr, " %s", port_conditions[j].name);
+                fprintf(stderr, "\ncombined with ! (not), comma (and) and | (or)\n");
+                exit(1);
+            }
+            if (c == 'W')
+                opt_where_count = rc;
+            else
+                opt_until_count = rc;
+            break;
+        case 'V':
+            if (parse_device(optarg, &opt_device) < 0) {
+                fprintf(stderr, "Invalid device %s, use VID:PID, /SERIAL or VID:PID/SERIAL\n",
+                    optarg);
+                exit(1);
+            }
+            opt_device_set = 1;
+            break;
+        case 'o':
+            opt_timeout = parse_duration(optarg);
+            if (opt_timeout < 0) {
+                fprintf(stderr, "Invalid timeout %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'A':
+            opt_adaptive = atoi(optarg);
+            break;
+        case 'B':
+            opt_budget = atoi(optarg);
+            break;
+        case 'E':
+            opt_enum = atoi(optarg);
+            break;
+        case 'C':
+            opt_clear = 1;
+            break;
+        case 'D':
+            opt_dry_run = 1;
+            break;
+        case 'y':
+            opt_sync = 1;
+            break;
+        case 'T':
+            opt_realtime = 1;
             break;
         case 'v':
             printf("%s\n", PROGRAM_VERSION);
@@ -741,6 +5053,41 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (opt_action == POWER_MIXED && opt_ports_set) {
+        fprintf(stderr, "Per-port actions already select ports, do not use -p with them!\n");
+        exit(1);
+    }
+    if ((opt_u1_timeout >= 0 || opt_residency > 0) && opt_action != POWER_KEEP) {
+        fprintf(stderr, "Action cannot be combined with -L or -M!\n");
+        exit(1);
+    }
+    if ((opt_action == POWER_CYCLE || opt_action == POWER_TOGGLE ||
+         opt_action == POWER_PULSE) && (opt_sync || opt_budget > 0 || opt_enum > 0))
+    {
+        fprintf(stderr, "Options -y, -B and -E only work with on, off and per-port actions!\n");
+        exit(1);
+    }
+    if (opt_sync && opt_adaptive > 0) {
+        fprintf(stderr, "Option -A cannot be combined with -y!\n");
+        exit(1);
+    }
+
+    if (strlen(opt_quirks) > 0) {
+        if (load_quirks(opt_quirks) < 0)
+            exit(1);
+    } else if (getenv("HOME") != NULL) {
+        snprintf(opt_quirks, sizeof(opt_quirks), "%s/%s",
+            getenv("HOME"), DEFAULT_QUIRKS_FILE);
+        FILE* f = fopen(opt_quirks, "r");
+        if (f != NULL) {
+            fclose(f);
+            load_quirks(opt_quirks);
+        }
+    }
+
+    if (opt_realtime && !opt_dry_run)
+        setup_realtime();
+
     rc = libusb_init(NULL);
     if (rc < 0) {
         fprintf(stderr,
@@ -782,97 +5129,255 @@ int main(int argc, char *argv[])
         goto cleanup;
     }
 
-    if (hub_phys_count > 1 && opt_action >= 0) {
+    if (opt_dry_run) {
+        printf("Dry run: requests below are not sent, sleeps are not paid\n");
+        dry_run_t0 = time_us();
+    }
+
+    if (strlen(opt_script) > 0) {
+        rc = run_script(opt_script) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+    if (strlen(opt_graph) > 0) {
+        rc = run_graph(opt_graph) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (opt_action == POWER_RESTORE) {
+        if (strlen(opt_snapshot) == 0) {
+            fprintf(stderr, "Use -S to specify snapshot file to restore!\n");
+            rc = 1;
+        } else {
+            rc = restore_snapshot(opt_snapshot) < 0 ? 1 : 0;
+        }
+        goto cleanup;
+    }
+    if (strlen(opt_snapshot) > 0 && opt_action == POWER_KEEP) {
+        rc = save_snapshot(opt_snapshot) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (opt_action == DEVICE_REBOOT) {
+        rc = reboot_device() < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (hub_phys_count > 1 && opt_action >= 0 && opt_action != PORT_WAIT &&
+        strlen(opt_location) == 0)
+    {
         fprintf(stderr,
-            "Error: changing port state for multiple hubs at once is not supported.\n"
-            "Use -l to limit operation to one hub!\n"
+            "Error: changing port state for multiple hubs at once requires\n"
+            "explicit hub location(s). Use -l to select hub(s)!\n"
         );
         exit(1);
     }
+    if (opt_where_count > 0) {
+        int matched = evaluate_where();
+        if (matched <= 0) {
+            if (matched == 0)
+                printf("No ports match condition\n");
+            rc = matched < 0 ? 1 : 0;
+            goto cleanup;
+        }
+    }
+    if (opt_action == PORT_WAIT) {
+        rc = wait_condition() < 0 ? 1 : 0;
+        goto cleanup;
+    }
+    if (opt_u1_timeout >= 0 || opt_residency > 0) {
+        rc = lpm_control() < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (opt_action == PORT_RESET || opt_action == PORT_SUSPEND ||
+        opt_action == PORT_RESUME)
+    {
+        rc = run_port_action(opt_action) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (opt_action == HUB_CALIBRATE) {
+        rc = calibrate() < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    if (opt_action == POWER_CYCLE || opt_action == POWER_TOGGLE ||
+        opt_action == POWER_PULSE)
+    {
+        rc = pulse_train(opt_action) < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+    /* hubs stay open for both phases */
+    struct libusb_device_handle * devhs[MAX_HUBS];
+    int waved[MAX_HUBS] = {0}; /* powered on in waves with dual hub */
+    open_hubs(devhs);
     int k; /* k=0 for power OFF, k=1 for power ON */
     for (k=0; k<2; k++) { /* up to 2 power actions - off/on */
-        if (k == 0 && opt_action == POWER_ON )
-            continue;
-        if (k == 1 && opt_action == POWER_OFF)
-            continue;
         if (k == 1 && opt_action == POWER_KEEP)
             continue;
-        int i;
-        for (i=0; i<hub_count; i++) {
-            if (hubs[i].actionable == 0)
+        if (opt_action != POWER_KEEP && phase_ports(k) == 0)
+            continue;
+        int i, n;
+        int order[MAX_HUBS];
+        plan_hub_order(k, order);
+        for (n=0; n<hub_count; n++) {
+            i = order[n];
+            if (devhs[i] == NULL)
                 continue;
-            printf("Current status for hub %s [%s]\n",
-                hubs[i].location, hubs[i].description
-            );
-            print_port_status(&hubs[i], opt_ports);
+            int cut_port;
+            int cut = hub_cut_by(i, &cut_port);
+            if (k == 1 && cut >= 0)
+                continue; /* it was powered off with upstream hub port */
+            struct libusb_device_handle * devh = devhs[i];
+            print_hub_status("Current", &hubs[i], devh, opt_ports);
             if (opt_action == POWER_KEEP) { /* no action, show status */
                 continue;
             }
-            struct libusb_device_handle * devh = NULL;
-            rc = libusb_open(hubs[i].dev, &devh);
-            if (rc == 0) {
-                /* will operate on these ports */
-                int ports = ((1 << hubs[i].nports) - 1) & opt_ports;
-                int request = (k == 0) ? LIBUSB_REQUEST_CLEAR_FEATURE
-                                       : LIBUSB_REQUEST_SET_FEATURE;
-                int port;
+            if (cut >= 0) {
+                printf("Skipping hub %s: it is powered off by hub %s port %d\n",
+                    hubs[i].location, hubs[cut].location, cut_port
+                );
+                continue;
+            }
+            if (opt_sync || (k == 1 && opt_enum > 0)) {
+                continue; /* done by sync_power() or staged_power_on() */
+            }
+            /* will operate on these ports */
+            int ports = hub_phase_ports(&hubs[i], k);
+            int request = (k == 0) ? LIBUSB_REQUEST_CLEAR_FEATURE
+                                   : LIBUSB_REQUEST_SET_FEATURE;
+            int port;
+            int wave[MAX_HUB_PORTS+1];
+            int waves = 1;
+            int dual = -1; /* dual hub switched in the same waves */
+            if (k == 1 && opt_budget > 0 && waved[i]) {
+                printf("Powered on in waves with hub %s\n",
+                    hubs[hubs[i].dual].location
+                );
+                waves = 0;
+            } else if (k == 1 && opt_budget > 0) {
+                waves = plan_power_waves(devhs, i, ports, wave);
+                printf("Powering on in %d wave(s) within %d mA budget\n",
+                    waves, opt_budget
+                );
+                dual = hubs[i].dual;
+                if (dual >= 0 && devhs[dual] != NULL && hub_cut_by(dual, &port) < 0)
+                    waved[dual] = 1;
+                else
+                    dual = -1;
+            }
+            int w;
+            for (w = 0; w < waves; w++) {
+                if (w > 0) {
+                    /* let inrush of previous wave settle */
+                    sleep_ms(hubs[i].pwr_on_2_good > POWER_WAVE_MIN_DELAY
+                             ? hubs[i].pwr_on_2_good : POWER_WAVE_MIN_DELAY);
+                }
                 for (port=1; port <= hubs[i].nports; port++) {
                     if ((1 << (port-1)) & ports) {
+                        if (waves > 1 && wave[port] != w)
+                            continue;
                         int port_status = get_port_status(devh, port);
-                        int power_mask = hubs[i].bcd_usb < USB_SS_BCD ? USB_PORT_STAT_POWER
-                                                                          : USB_SS_PORT_STAT_POWER;
+                        int power_mask = port_power_mask(&hubs[i]);
                         if (k == 0 && !(port_status & power_mask))
                             continue;
-                        if (k == 1 && (port_status & power_mask))
-                            continue;
-                        int repeat = 1;
-                        if (k == 0)
-                            repeat = opt_repeat;
-                        if (!(port_status & ~power_mask))
-                            repeat = 1;
-                        while (repeat-- > 0) {
-                            rc = libusb_control_transfer(devh,
-                                LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
-                                request, USB_PORT_FEAT_POWER,
-                                port, NULL, 0, USB_CTRL_GET_TIMEOUT
-                            );
-                            if (rc < 0) {
-                                perror("Failed to control port power!\n");
-                            }
-                            if (repeat > 0) {
-                                sleep_ms(opt_wait);
+                        if (dual >= 0 && port <= hubs[dual].nports &&
+                            ((1 << (port-1)) & hub_phase_ports(&hubs[dual], k)))
+                        {
+                            int dual_status = get_port_status(devhs[dual], port);
+                            if (dual_status >= 0 &&
+                                !(dual_status & port_power_mask(&hubs[dual])))
+                            {
+                                switch_port_power(devhs[dual], &hubs[dual], port,
+                                    k, dual_status);
                             }
                         }
+                        if (k == 1 && (port_status & power_mask))
+                            continue;
+                        switch_port_power(devh, &hubs[i], port, k, port_status);
                     }
                 }
-                /* USB3 hubs need extra delay to actually turn off: */
-                if (k==0 && hubs[i].bcd_usb >= USB_SS_BCD)
-                    sleep_ms(150);
+            }
+            if (k==0 && hubs[i].settle > 0)
+                sleep_ms(hubs[i].settle);
+            if (waves > 0) {
                 printf("Sent power %s request\n",
                     request == LIBUSB_REQUEST_CLEAR_FEATURE ? "off" : "on"
                 );
-                printf("New status for hub %s [%s]\n",
-                    hubs[i].location, hubs[i].description
+            }
+            if (k == 0 && opt_adaptive > 0) {
+                printf("Hub %s [%s] needed %d power off attempt(s)\n",
+                    hubs[i].location, hubs[i].vendor, hubs[i].off_attempts
                 );
-                print_port_status(&hubs[i], opt_ports);
-
-                if (k == 1 && opt_reset == 1) {
-                    printf("Resetting hub...\n");
-                    rc = libusb_reset_device(devh);
-                    if (rc < 0) {
-                        perror("Reset failed!\n");
-                    } else {
-                        printf("Reset successful!\n");
-                    }
+            }
+            print_hub_status("New", &hubs[i], devh, opt_ports);
+
+            if (k == 1 && opt_reset == 1)
+                reset_hub(devh);
+        }
+        if (k == 1 && opt_enum > 0 && opt_action != POWER_KEEP) {
+            rc = staged_power_on(devhs);
+            if (rc < 0) {
+                fprintf(stderr, "Failed to power on ports: %s\n",
+                    libusb_error_name(rc));
+            }
+        } else if (opt_sync && opt_action != POWER_KEEP) {
+            rc = sync_power(devhs, k, 1);
+            if (rc < 0) {
+                fprintf(stderr, "Failed to control port power: %s\n",
+                    libusb_error_name(rc));
+            }
+        }
+        if (k == 0 && (phase_ports(0) & phase_ports(1))) { /* cycle */
+            int64_t off_start = 0;
+            for (i=0; i<hub_count; i++) {
+                int port;
+                for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+                    int64_t t = hubs[i].off_time[port];
+                    if (t != 0 && (off_start == 0 || t < off_start))
+                        off_start = t;
                 }
             }
-            libusb_close(devh);
+            if (opt_realtime && off_start != 0) {
+                /* off time is counted from first port switched off */
+                sleep_until_us(off_start + opt_delay);
+            } else {
+                sleep_until_us(time_us() + opt_delay);
+            }
+        }
+    }
+    if (opt_realtime && (phase_ports(0) & phase_ports(1))) {
+        int i;
+        for (i=0; i<hub_count; i++) {
+            int port;
+            for (port=1; port <= hubs[i].nports && port <= MAX_HUB_PORTS; port++) {
+                if (hubs[i].off_time[port] == 0 || hubs[i].on_time[port] == 0)
+                    continue;
+                printf("Hub %s port %d was off for %.3f ms (requested %.3f ms)\n",
+                    hubs[i].location, port,
+                    (hubs[i].on_time[port] - hubs[i].off_time[port]) / 1000.0,
+                    opt_delay / 1000.0
+                );
+            }
         }
-        if (k == 0 && opt_action == POWER_CYCLE)
-            sleep_ms(opt_delay * 1000);
     }
+    close_hubs(devhs, 0);
     rc = 0;
 cleanup:
+    if (report_port_errors() > 0)
+        rc = 1;
+    if (opt_adaptive > 0 && !opt_dry_run && strlen(opt_quirks) > 0 &&
+        save_attempts(opt_quirks) < 0)
+    {
+        rc = 1;
+    }
+    if (opt_dry_run && dry_run_t0 != 0) {
+        dry_run_print(NULL, NULL, 0, 0); /* flush pending sleep */
+        printf("Dry run: %d request(s), estimated time %.3f ms "
+               "(%.3f ms in sleeps)\n", dry_run_requests,
+            (time_us() - dry_run_t0) / 1000.0, dry_run_clock / 1000.0);
+    }
     if (usb_devs)
         libusb_free_device_list(usb_devs, 1);
     usb_devs = NULL;